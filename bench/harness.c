@@ -0,0 +1,155 @@
+// benchmark harness: runs each script several times under the interpreter
+// and prints one tab separated line per script
+//
+//     bench-harness [-n runs] <interpreter> [option ...] -- <script> ...
+//
+// Columns: script name, runs, minimum and median wall time in seconds,
+// instructions executed, instructions per second at the median wall time
+// and peak resident set size in KiB over all timed runs. The timed runs do
+// not pass `--stats`, which switches the default engine to its slower
+// counting loop; the instruction count comes from one more, untimed run
+// with `--stats` and is 0 for the engines that do not count. The scripts'
+// own output goes to /dev/null.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int by_time(const void* a, const void* b)
+{
+    double x, y;
+    x = *(double*)a;
+    y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+// run `argv` once, returns its exit status or -1. The wall time, the
+// instruction count and the peak RSS are stored through the pointers.
+int run(char** argv, double* wall, int64_t* instructions, int64_t* rss)
+{
+    int fd[2], pid, status, n, len;
+    char buf[4096];
+    char* p;
+    struct rusage usage;
+    double start;
+
+    if (pipe(fd) < 0) {
+        return -1;
+    }
+    start = now();
+    if ((pid = fork()) < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        // stdout is discarded, stderr carries the instruction count
+        close(fd[0]);
+        n = open("/dev/null", O_WRONLY);
+        dup2(n, 1);
+        dup2(fd[1], 2);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(fd[1]);
+    // keep the last part of stderr, the count is printed at exit
+    len = 0;
+    while ((n = read(fd[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len = len + n;
+        if (len == sizeof(buf) - 1) {
+            memmove(buf, buf + len / 2, len - len / 2);
+            len = len - len / 2;
+        }
+    }
+    buf[len] = 0;
+    close(fd[0]);
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return -1;
+    }
+    *wall = now() - start;
+    *rss = usage.ru_maxrss;
+    *instructions = 0;
+    if ((p = strstr(buf, "instructions: "))) {
+        *instructions = strtoll(p + 14, 0, 10);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char** argv)
+{
+    char **child, **counted;
+    char* name;
+    double* wall;
+    double ignored;
+    int64_t instructions, rss, peak;
+    int runs, nopt, i, k, status;
+
+    argc--;
+    argv++;
+    runs = 5;
+    if (argc > 1 && !strcmp(*argv, "-n")) {
+        runs = atoi(argv[1]);
+        argc = argc - 2;
+        argv = argv + 2;
+    }
+    // the interpreter and its options run up to `--`
+    nopt = 0;
+    while (nopt < argc && strcmp(argv[nopt], "--")) {
+        nopt++;
+    }
+    if (runs < 1 || nopt == 0 || nopt >= argc - 1) {
+        fprintf(stderr, "usage: bench-harness [-n runs] <interpreter> [option ...] -- <script> ...\n");
+        return 1;
+    }
+
+    child = malloc((nopt + 2) * sizeof(char*));
+    memcpy(child, argv, nopt * sizeof(char*));
+    child[nopt + 1] = 0;
+    counted = malloc((nopt + 3) * sizeof(char*));
+    memcpy(counted, argv, nopt * sizeof(char*));
+    counted[nopt] = "--stats";
+    counted[nopt + 2] = 0;
+    wall = malloc(runs * sizeof(double));
+
+    printf("script\truns\twall_min_s\twall_median_s\tinstructions\tinstr_per_s\tmax_rss_kb\n");
+    i = nopt + 1;
+    while (i < argc) {
+        child[nopt] = argv[i];
+        counted[nopt + 1] = argv[i];
+        name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        peak = 0;
+        k = 0;
+        while (k < runs) {
+            status = run(child, &wall[k], &instructions, &rss);
+            if (status < 0 || status == 127) {
+                fprintf(stderr, "%s: run failed\n", argv[i]);
+                return 1;
+            }
+            if (rss > peak) {
+                peak = rss;
+            }
+            k++;
+        }
+        status = run(counted, &ignored, &instructions, &rss);
+        if (status < 0 || status == 127) {
+            fprintf(stderr, "%s: run failed\n", argv[i]);
+            return 1;
+        }
+        qsort(wall, runs, sizeof(double), by_time);
+        printf("%.*s\t%d\t%.6f\t%.6f\t%ld\t%.0f\t%ld\n", (int)(strcspn(name, ".")), name, runs,
+               wall[0], wall[runs / 2], (long)instructions, instructions / wall[runs / 2], (long)peak);
+        fflush(stdout);
+        i++;
+    }
+    return 0;
+}
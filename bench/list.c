@@ -0,0 +1,42 @@
+// linked lists of malloc'd nodes: allocation and pointer chasing.
+// A node is two int cells, { value, next }; ints are 8 bytes wide.
+int *push(int *head, int value)
+{
+    int *node;
+    node = malloc(16);
+    node[0] = value;
+    node[1] = (int)head;
+    return node;
+}
+
+int sum(int *node)
+{
+    int s;
+    s = 0;
+    while (node) {
+        s = s + node[0];
+        node = (int *)node[1];
+    }
+    return s;
+}
+
+int main()
+{
+    int *head;
+    int round, i, total;
+
+    total = 0;
+    round = 0;
+    while (round < 100) {
+        head = 0;
+        i = 0;
+        while (i < 20000) {
+            head = push(head, i);
+            i = i + 1;
+        }
+        total = total + sum(head);
+        round = round + 1;
+    }
+    printf("average %d\n", total / 100);
+    return 0;
+}
@@ -0,0 +1,48 @@
+// matrix multiply of n x n int matrices walked with pointer arithmetic
+int *matrix(int n, int seed)
+{
+    int *m, *p, *end;
+    m = malloc(n * n * 8);
+    p = m;
+    end = m + n * n;
+    while (p < end) {
+        *p = (seed & 1023) % 10;
+        seed = seed * 31 + 7;
+        p = p + 1;
+    }
+    return m;
+}
+
+int main()
+{
+    int *a, *b, *c, *row, *col, *out;
+    int n, i, j, k, s;
+
+    n = 160;
+    a = matrix(n, 1);
+    b = matrix(n, 2);
+    c = malloc(n * n * 8);
+    out = c;
+    i = 0;
+    while (i < n) {
+        j = 0;
+        while (j < n) {
+            row = a + i * n;
+            col = b + j;
+            s = 0;
+            k = 0;
+            while (k < n) {
+                s = s + *row * *col;
+                row = row + 1;
+                col = col + n;
+                k = k + 1;
+            }
+            *out = s;
+            out = out + 1;
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    printf("c[0] = %d, c[n*n-1] = %d\n", c[0], c[n * n - 1]);
+    return 0;
+}
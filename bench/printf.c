@@ -0,0 +1,11 @@
+// formatted output in a loop, dominated by the PRTF library instruction
+int main()
+{
+    int i;
+    i = 0;
+    while (i < 500000) {
+        printf("line %d: %d %x %s\n", i, i * i, i, "text");
+        i = i + 1;
+    }
+    return 0;
+}
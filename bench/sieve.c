@@ -0,0 +1,25 @@
+// sieve of Eratosthenes over a byte array: loops, char loads and stores
+int main()
+{
+    char *flags;
+    int n, i, j, count;
+
+    n = 2000000;
+    flags = malloc(n + 1);
+    memset(flags, 1, n + 1);
+    count = 0;
+    i = 2;
+    while (i <= n) {
+        if (flags[i]) {
+            count = count + 1;
+            j = i + i;
+            while (j <= n) {
+                flags[j] = 0;
+                j = j + i;
+            }
+        }
+        i = i + 1;
+    }
+    printf("primes below %d: %d\n", n, count);
+    return 0;
+}
@@ -0,0 +1,6 @@
+// startup cost: an empty program, the time is spent setting up the
+// interpreter and compiling nothing
+int main()
+{
+    return 0;
+}
@@ -0,0 +1,37 @@
+// substring search: memcmp at every position of a large generated text
+int main()
+{
+    char *text, *needle, *p, *end;
+    int n, i, found;
+
+    n = 3000000;
+    text = malloc(n + 1);
+    i = 0;
+    while (i < n) {
+        text[i] = 'a' + (i * 7 + i / 13) % 26;
+        i = i + 1;
+    }
+    text[n] = 0;
+
+    // plant the needle a few times
+    needle = "needle";
+    i = 0;
+    while (i < 6) {
+        text[n / 4 + i] = needle[i];
+        text[n / 2 + i] = needle[i];
+        text[n - 6 + i] = needle[i];
+        i = i + 1;
+    }
+
+    found = 0;
+    p = text;
+    end = text + n - 6;
+    while (p <= end) {
+        if (*p == 'n' && !memcmp(p, needle, 6)) {
+            found = found + 1;
+        }
+        p = p + 1;
+    }
+    printf("found %d\n", found);
+    return 0;
+}
@@ -0,0 +1,47 @@
+// libcinterp: the interpreter as a library, built from main.c with
+// CINTERP_LIBRARY defined (the `cinterp` CMake targets)
+//
+// Each interpreter is a context with its own text, data, stack and symbol
+// table, so scripts compiled into different contexts cannot see each other.
+// A context can compile several sources, which share its globals and
+// functions, and call any function with integer arguments:
+//
+//     cinterp* c = cinterp_new();
+//     if (cinterp_compile(c, "int add(int a, int b) { return a + b; }") == 0) {
+//         int64_t args[2] = { 1, 2 }, sum;
+//         cinterp_call(c, cinterp_function(c, "add"), 2, args, &sum);
+//     }
+//     cinterp_free(c);
+//
+// Compile errors are printed to stdout as by the command line interpreter
+// and make cinterp_compile() return -1. While a function declared by a
+// prototype is not defined by any compile, cinterp_call() reports it the way
+// --link does and returns -1. A script calling exit(n) ends the call with
+// result n. The calls are thread safe: calls into different contexts run in
+// parallel, while calls into one context take turns, and so do compiles, into
+// any context. The blocks scripts malloc() belong to the context's heap and
+// go with it.
+#ifndef CINTERP_H
+#define CINTERP_H
+
+#include <stdint.h>
+
+typedef struct cinterp cinterp;
+
+// a new context, 0 when its segments cannot be allocated
+cinterp* cinterp_new(void);
+
+// compile `source` into the context, returns 0 or -1
+int cinterp_compile(cinterp* c, const char* source);
+
+// the function `name` compiled into the context, 0 when there is none
+void* cinterp_function(cinterp* c, const char* name);
+
+// call `function` with `argc` arguments, storing its return value in
+// `*result`. Returns 0, or -1 after reporting the undefined functions.
+int cinterp_call(cinterp* c, void* function, int argc, const int64_t* args, int64_t* result);
+
+// release the context and everything compiled into it
+void cinterp_free(cinterp* c);
+
+#endif
@@ -5,16 +5,35 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <signal.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef CINTERP_LIBRARY
+#include <setjmp.h>
+// built as the embeddable library (see cinterp.h): an error while compiling
+// or running returns from the library call in progress instead of ending
+// the host process
+jmp_buf cinterp_fail;
+#define exit(code) longjmp(cinterp_fail, 1)
+#endif
 
 int token;  // current token
 char* src, *old_src;  // pointer to source code string;
-int poolsize;  // default size of text/data/stack
+int64_t text_size, data_size, stack_size, symbols_size;  // segment sizes in bytes
 int line;  // line number
 
 int64_t* text,  // text segment
     * old_text, // for dump text segment
     * stack;  // stack
-char* data;  // data segment
+char* data,  // data segment
+    * old_data;  // start of the data segment
 
 int64_t* pc, *bp, *sp, ax, cycle;  // virtual machine registers
 
@@ -29,6 +48,7 @@ enum {
     ENT,  // enter (make new call frame)
     ADJ,  // remove arguments from frame
     LEV,  // restore old call frame
+    TCALL,  // tail call, reuses the current frame
     LI,  // load integer addressed by `ax` into `ax`
     LC,  // load char addressed by `ax` into `ax`
     SI,  // store `ax` as integer to memory addressed by TOS
@@ -55,9 +75,21 @@ enum {
     CLOS,  // close
     PRTF,  // printf
     MALC,  // malloc
+    FREE,  // free
     MSET,  // memset
     MCMP,  // memcmp
-    EXIT  // exit
+    ARST,  // arena_reset
+    EXIT,  // exit
+    // superinstructions, produced by the peephole pass from `superinstruction`
+    LLIP,  // LEA n; LI; PUSH
+    LLI,  // LEA n; LI
+    LEAP,  // LEA n; PUSH
+    LIP,  // LI; PUSH
+    IMMP,  // IMM k; PUSH
+    ADDI,  // PUSH; IMM k; ADD
+    SUBI,  // PUSH; IMM k; SUB
+    MULI,  // PUSH; IMM k; MUL
+    LTI  // PUSH; IMM k; LT
 };
 
 // token and classes (operators last and in precedence order)
@@ -117,7 +149,18 @@ struct identifier {
 
 int64_t token_val;  // value of current token (mainly for number)
 int64_t* current_id,  // current parsed ID
-    * symbols;  // symbol table
+    * symbols,  // symbol table
+    * symbols_end;  // first free entry of the symbol table
+
+// open addressing index of the symbol table on the identifiers' hash, with
+// `symbol_mask + 1` slots, at least twice the capacity of the table
+int64_t** symbol_index;
+int symbol_mask;
+
+// scope stack: the identifiers the current function's parameters and locals
+// shadow, restored from their BClass/BType/BValue when the function ends
+int64_t** scope;
+int scope_top;
 
 // 我们不支持struct，故用下面的编码方式来表示struct
 // fields of identifier
@@ -131,6 +174,8 @@ enum {
     BType,
     BClass,
     BValue,
+    Extent,  // end of a function's code in text
+    Params,  // number of parameters of a function
     IdSize
 };
 
@@ -146,7 +191,7 @@ enum_decl ::= 'enum' [id] '{' id ['=' 'num'] {',' id ['=' 'num'] '}'
 
 variable_decl ::= type {'*'} id { ',' {'*'} id } ';'
 
-function_decl ::= type {'*'} id '(' parameter_decl ')' '{' body_decl '}'
+function_decl ::= type {'*'} id '(' parameter_decl ')' ('{' body_decl '}' | ';')
 
 parameter_decl ::= type {'*'} id {',' type {'*'} id}
 
@@ -176,19 +221,275 @@ int expr_type;  // the type of an expression
 // 5: local var 1
 // 6: local var 2
 int index_of_bp;  // index of bp pointer on stack
+int64_t* function_entry;  // the ENT of the function being compiled
+int* text_line;  // source line of each cell of the text segment
+int64_t* line_at;  // last cell whose line is recorded
+int inline_limit;  // largest function (in text cells) inlined at call sites
 
-void next()
+// number of operands following an instruction in the text segment
+int op_operands(int64_t op)
+{
+    if (op == LEA || op == IMM || op == JMP || op == CALL || op == JZ ||
+        op == JNZ || op == ENT || op == ADJ) {
+        return 1;
+    }
+    if (op == TCALL) {
+        return 2;  // target, number of arguments
+    }
+    if (op == LLIP || op == LLI || op == LEAP || op == IMMP || op == ADDI ||
+        op == SUBI || op == MULI || op == LTI) {
+        return 1;
+    }
+    return 0;
+}
+
+// whether the operand of an instruction is an address in the text segment
+int op_is_jump(int64_t op)
+{
+    return op == JMP || op == CALL || op == JZ || op == JNZ || op == TCALL;
+}
+
+// whether the operand of an instruction may be an address in data
+int op_is_immediate(int64_t op)
+{
+    return op == IMM || op == IMMP || op == ADDI || op == SUBI || op == MULI || op == LTI;
+}
+
+// mnemonics of the instructions, in enum order
+char* op_name[] = {
+    "LEA", "IMM", "JMP", "CALL", "JZ", "JNZ", "ENT", "ADJ", "LEV", "TCALL",
+    "LI", "LC", "SI", "SC", "PUSH", "OR", "XOR", "AND", "EQ", "NE",
+    "LT", "GT", "LE", "GE", "SHL", "SHR", "ADD", "SUB", "MUL", "DIV",
+    "MOD", "OPEN", "READ", "CLOS", "PRTF", "MALC", "FREE", "MSET", "MCMP", "ARST", "EXIT",
+    "LLIP", "LLI", "LEAP", "LIP", "IMMP", "ADDI", "SUBI", "MULI", "LTI"
+};
+
+// the code emitted since the last token belongs to the current line
+void record_lines()
+{
+    if (text_line) {
+        if (line_at > text) {
+            line_at = text;
+        }
+        while (line_at < text) {
+            text_line[++line_at - old_text] = line;
+        }
+    }
+}
+
+// batch lexer
+//
+// tokenize() turns the whole source into an array of lexemes up front and
+// next() hands them to the parser one by one. Runs of white space, comments
+// and the characters of identifiers and numbers are classified 16 bytes at a
+// time with SSE2 where available. Identifiers are looked up (or entered) in
+// the symbol table by the lexer, but their token is read from the table when
+// they are consumed. String literals are only located by the lexer: they are
+// copied into the data segment when consumed, so the data layout is the one
+// the parser builds.
+struct lexeme {
+    int kind;  // token, Id for every identifier
+    int line;
+    int64_t value;  // number, symbol index of an identifier, source of a string
+} *lexemes, *lex_at;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+
+// bit i is set for each of the 16 bytes at p that is in [lo, hi]
+int byte_range(__m128i c, char lo, char hi)
+{
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                                           _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1))));
+}
+
+int byte_eq(__m128i c, char k)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(k)));
+}
+#endif
+
+// skip spaces, tabs, carriage returns and newlines, counting the newlines
+char* skip_space(char* p, char* end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i c;
+    int space, newline, n;
+    while (p + 16 <= end) {
+        c = _mm_loadu_si128((__m128i*)p);
+        newline = byte_eq(c, '\n');
+        space = byte_eq(c, ' ') | byte_eq(c, '\t') | byte_eq(c, '\r') | newline;
+        n = __builtin_ctz(~space);  // 16 when all of them are
+        line = line + __builtin_popcount(newline & ((1 << n) - 1));
+        p = p + n;
+        if (n < 16) {
+            return p;
+        }
+    }
+#endif
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        if (*p++ == '\n') {
+            ++line;
+        }
+    }
+    return p;
+}
+
+// the end of the line at p, a comment or a macro
+char* skip_line(char* p, char* end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i c;
+    int stop;
+    while (p + 16 <= end) {
+        c = _mm_loadu_si128((__m128i*)p);
+        if ((stop = byte_eq(c, '\n') | byte_eq(c, 0))) {
+            return p + __builtin_ctz(stop);
+        }
+        p = p + 16;
+    }
+#endif
+    while (*p != 0 && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+// the end of the run of identifier characters (or only digits) at p
+char* skip_word(char* p, char* end, int digits)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i c;
+    int word, n;
+    while (p + 16 <= end) {
+        c = _mm_loadu_si128((__m128i*)p);
+        word = byte_range(c, '0', '9');
+        if (!digits) {
+            word = word | byte_range(c, 'a', 'z') | byte_range(c, 'A', 'Z') | byte_eq(c, '_');
+        }
+        n = __builtin_ctz(~word);
+        p = p + n;
+        if (n < 16) {
+            return p;
+        }
+    }
+#endif
+    while ((*p >= '0' && *p <= '9') || (!digits && ((*p >= 'a' && *p <= 'z') ||
+           (*p >= 'A' && *p <= 'Z') || *p == '_'))) {
+        p++;
+    }
+    return p;
+}
+
+// the symbol table entry of the identifier `name` of `len` characters,
+// entered if it is not there yet
+int64_t* symbol_lookup(char* name, int len, int hash)
+{
+    int64_t* id;
+    int i;
+
+    // look for existing identifier through the hash index
+    i = (unsigned)hash & symbol_mask;
+    while ((id = symbol_index[i])) {
+        if (id[Hash] == hash && !memcmp((char*)id[Name], name, len)) {
+            return id;
+        }
+        i = (i + 1) & symbol_mask;
+    }
+    // store new ID
+    if (symbols_end + 2 * IdSize > (int64_t*)((char*)symbols + symbols_size)) {
+        printf("%d: too many identifiers\n", line);
+        exit(-1);
+    }
+    id = symbol_index[i] = symbols_end;
+    symbols_end = symbols_end + IdSize;
+    id[Name] = (int64_t)name;
+    id[Hash] = hash;
+    id[Token] = Id;
+    return id;
+}
+
+// the symbol table entry of the zero terminated `name`, entered if it is not
+// there yet
+int64_t* symbol_named(char* name)
+{
+    int hash, len;
+
+    // the lexer's hash
+    hash = name[0];
+    len = 1;
+    while (name[len]) {
+        hash = hash * 147 + name[len++];
+    }
+    return symbol_lookup(name, len, hash);
+}
+
+// keywords and library functions, entered in the symbol table at startup
+// with the hash the lexer computes for them (`hash = hash * 147 + c`)
+struct {
+    char* name;
+    int hash;
+    int token, class, value;
+} builtin[] = {
+    { "char", 316737486, Char, 0, 0 },
+    { "else", 323179601, Else, 0, 0 },
+    { "enum", 323223121, Enum, 0, 0 },
+    { "if", 15537, If, 0, 0 },
+    { "int", 2285231, Int, 0, 0 },
+    { "return", -12847000, Return, 0, 0 },
+    { "sizeof", 1795670240, Sizeof, 0, 0 },
+    { "while", 64985305, While, 0, 0 },
+    { "open", 355029218, Id, Sys, OPEN },
+    { "read", 364320490, Id, Sys, READ },
+    { "close", -671220948, Id, Sys, CLOS },
+    { "printf", 1883410885, Id, Sys, PRTF },
+    { "malloc", -1516293496, Id, Sys, MALC },
+    { "free", 326483720, Id, Sys, FREE },
+    { "memset", 354828361, Id, Sys, MSET },
+    { "memcmp", 354483789, Id, Sys, MCMP },
+    { "arena_reset", 630735483, Id, Sys, ARST },
+    { "exit", 323437454, Id, Sys, EXIT },
+    { "void", 377243848, Char, 0, 0 },  // handle void type
+    { "main", 348352625, Id, 0, 0 },
+    { 0 }
+};
+
+// lex the source at `src` into `lexemes`, ending with a 0 lexeme
+void tokenize()
 {
-    char* last_pos;
+    struct lexeme* lex;
+    int64_t size;
+    char *end, *last_pos;
     int hash;
+    int i;
+
+    end = src + strlen(src) + 1;
+    free(lexemes);
+    // about one lexeme per four characters, grown when needed
+    size = (end - src) / 4 + 16;
+    if (!(lex = lexemes = malloc(size * sizeof(struct lexeme)))) {
+        printf("could not malloc(%ld) for lexemes\n", size * sizeof(struct lexeme));
+        exit(-1);
+    }
 
-    while ((token = *src) != 0) {
+    while (1) {
+        if (lex - lexemes == size - 1) {
+            size = size * 2;
+            if (!(lexemes = realloc(lexemes, size * sizeof(struct lexeme)))) {
+                printf("could not malloc(%ld) for lexemes\n", size * sizeof(struct lexeme));
+                exit(-1);
+            }
+            lex = lexemes + size / 2 - 1;
+        }
+        src = skip_space(src, end);
+        lex->line = line;
+        lex->value = 0;
+        if ((token = *src) == 0) {
+            break;
+        }
         ++src;
         // parse token here
-        if (token == '\n') {
-            ++line;
-        }
-        else if (token == '=') {
+        if (token == '=') {
             // parse '==' and '='
             if (*src == '=') {
                 src ++;
@@ -196,7 +497,6 @@ void next()
             } else {
                 token = Assign;
             }
-            return;
         }
         else if (token == '+') {
             // parse '+' and '++'
@@ -206,7 +506,6 @@ void next()
             } else {
                 token = Add;
             }
-            return;
         }
         else if (token == '-') {
             // parse '-' and '--'
@@ -216,7 +515,6 @@ void next()
             } else {
                 token = Sub;
             }
-            return;
         }
         else if (token == '!') {
             // parse '!='
@@ -224,7 +522,6 @@ void next()
                 src++;
                 token = Ne;
             }
-            return;
         }
         else if (token == '<') {
             // parse '<=', '<<' or '<'
@@ -237,7 +534,6 @@ void next()
             } else {
                 token = Lt;
             }
-            return;
         }
         else if (token == '>') {
             // parse '>=', '>>' or '>'
@@ -250,7 +546,6 @@ void next()
             } else {
                 token = Gt;
             }
-            return;
         }
         else if (token == '|') {
             // parse '|' or '||'
@@ -260,7 +555,6 @@ void next()
             } else {
                 token = Or;
             }
-            return;
         }
         else if (token == '&') {
             // parse '&' and '&&'
@@ -270,50 +564,41 @@ void next()
             } else {
                 token = And;
             }
-            return;
         }
         else if (token == '^') {
             token = Xor;
-            return;
         }
         else if (token == '%') {
             token = Mod;
-            return;
         }
         else if (token == '*') {
             token = Mul;
-            return;
         }
         else if (token == '[') {
             token = Brak;
-            return;
         }
         else if (token == '?') {
             token = Cond;
-            return;
         }
         else if (token == '~' || token == ';' || token == '{' || token == '}' || token == '(' || token == ')' || token == ']' || token == ',' || token == ':') {
             // directly return the character as token;
-            return;
         }
         // parse comments
         else if (token == '/') {
             if (*src == '/') {
                 // skip comments
-                while (*src != 0 && *src != '\n') {
-                    ++src;
-                }
+                src = skip_line(src, end);
+                continue;
             } else {
                 // divide operator
                 token = Div;
-                return;
             }
         }
         // parse string
         else if (token == '"' || token == '\'') {
-            // parse string literal, currently, the only supported escape
-            // character is '\n', store the string literal into data.
-            last_pos = data;
+            // a string literal is copied into data by next(), a character
+            // is a Num. The only supported escape character is '\n'.
+            last_pos = src;
             while (*src != 0 && *src != token) {
                 token_val = *src++;
                 if (token_val == '\\') {
@@ -323,21 +608,14 @@ void next()
                         token_val = '\n';
                     }
                 }
-
-                if (token == '"') {
-                    *data++ = token_val;
-                }
             }
-
             src++;
-            // if it is a single character, return Num token
             if (token == '"') {
-                token_val = (int64_t)last_pos;
+                lex->value = (int64_t)last_pos;
             } else {
                 token = Num;
+                lex->value = token_val;
             }
-
-            return;
         }
         // parse number
         else if (token >= '0' && token <= '9') {
@@ -345,7 +623,8 @@ void next()
             token_val = token - '0';
             if (token_val > 0) {
                 // dec, starts with [1-9]
-                while (*src >= '0' && *src <= '9') {
+                last_pos = skip_word(src, end, 1);
+                while (src < last_pos) {
                     token_val = token_val*10 + *src++ - '0';
                 }
             } else {
@@ -364,47 +643,72 @@ void next()
                     }
                 }
             }
-
             token = Num;
-            return;
+            lex->value = token_val;
         }
         else if ((token >= 'a' && token <= 'z') || (token >= 'A' && token <= 'Z') || token == '_')
         {
             // parse identifier
             last_pos = src - 1;
+            src = skip_word(src, end, 0);
             hash = token;
-            while ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') ||
-                (*src >= '0' && *src <= '9') || (*src == '_'))
-            {
-                hash = hash * 147 + *src;
-                src++;
-            }
-            // look for existing identifier, linear search
-            current_id = symbols;
-            while (current_id[Token]) {
-                if (current_id[Hash] == hash &&
-                    !memcmp((char*)current_id[Name], last_pos, src - last_pos))
-                {
-                    // found one, return
-                    token = current_id[Token];
-                    return;
-                }
-                current_id = current_id + IdSize;
+            i = 1;
+            while (last_pos + i < src) {
+                hash = hash * 147 + last_pos[i++];
             }
-            // store new ID
-            current_id[Name] = (int64_t)last_pos;
-            current_id[Hash] = hash;
-            token = current_id[Token] = Id;
-            return;
+            lex->value = (symbol_lookup(last_pos, src - last_pos, hash) - symbols) / IdSize;
+            token = Id;
         }
         else if (token == '#') {
             // skip macro, because we will not support it
-            while (*src != 0 && *src != '\n') {
-                src++;
+            src = skip_line(src, end);
+            continue;
+        }
+        else {
+            continue;  // anything else is ignored
+        }
+        lex->kind = token;
+        lex++;
+    }
+    lex->kind = 0;
+    lex_at = lexemes;
+}
+
+// advance to the next lexeme
+void next()
+{
+    char *p, *start;
+    int64_t c;
+
+    record_lines();
+
+    token = lex_at->kind;
+    line = lex_at->line;
+    if (token == Id) {
+        current_id = symbols + lex_at->value * IdSize;
+        token = current_id[Token];
+    } else if (token == Num) {
+        token_val = lex_at->value;
+    } else if (token == '"') {
+        // store the string literal into data
+        start = data;
+        p = (char*)lex_at->value;
+        while (*p != 0 && *p != '"') {
+            c = *p++;
+            if (c == '\\') {
+                // escape character
+                c = *p++;
+                if (c == 'n') {
+                    c = '\n';
+                }
             }
+            *data++ = c;
         }
+        token_val = (int64_t)start;
+    }
+    if (token) {
+        lex_at++;
     }
-    return;
 }
 
 void match(int tk)
@@ -416,11 +720,245 @@ void match(int tk)
     next();
 }
 
+// the IMM most recently emitted for a constant operand; it is only valid
+// while it is the last instruction of text (const_at == text - 1) and no jump
+// label has been placed after it
+int64_t* const_at;
+
+// the CALL most recently emitted, valid while its ADJ (if any) ends text and
+// no jump label has been placed after it
+int64_t* call_at;
+
+// set once the function being compiled takes the address of a local or a
+// parameter; its frame must then outlive its calls, so no tail calls
+int frame_taken;
+
+// the calls return statements of the function being compiled end with,
+// made tail calls at its end unless frame_taken is set by then
+int64_t** tail_calls;
+int tail_count, tail_size;
+
+// where stack_depth() resumes its scan, the start of the last instruction
+// it saw, with depth_then cells pushed before it. That instruction is
+// rescanned since it may still be rewritten in place (LI into PUSH); code
+// taken back below it drops the cache through rewind_text().
+int64_t* depth_at;
+int depth_then;
+
+void rewind_text(int64_t* to)
+{
+    text = to;
+    if (depth_at > text + 1) {
+        depth_at = 0;
+    }
+}
+
+// emit `IMM k` for a compile time constant
+void emit_constant(int64_t k)
+{
+    *++text = IMM;
+    *++text = k;
+    const_at = text - 1;
+}
+
+// emit the PUSH of the left operand of a binary operator, returns where the
+// operand was compiled if it is a constant
+int64_t* emit_push()
+{
+    int64_t* left;
+    left = (const_at == text - 1) ? const_at : 0;
+    *++text = PUSH;
+    return left;
+}
+
+// value of `a op b` computed at compile time, returns 0 for the operations
+// whose result depends on the host (shift counts out of range) or that would
+// trap (division by zero, overflowing division)
+int fold(int op, int64_t a, int64_t b, int64_t* r)
+{
+    if ((op == SHL || op == SHR) && (b < 0 || b > 63)) {
+        return 0;
+    }
+    if ((op == DIV || op == MOD) && (b == 0 || (b == -1 && a == INT64_MIN))) {
+        return 0;
+    }
+    if (op == OR) *r = a | b;
+    else if (op == XOR) *r = a ^ b;
+    else if (op == AND) *r = a & b;
+    else if (op == EQ) *r = a == b;
+    else if (op == NE) *r = a != b;
+    else if (op == LT) *r = a < b;
+    else if (op == GT) *r = a > b;
+    else if (op == LE) *r = a <= b;
+    else if (op == GE) *r = a >= b;
+    else if (op == SHL) *r = (int64_t)((uint64_t)a << b);
+    else if (op == SHR) *r = a >> b;
+    else if (op == ADD) *r = (int64_t)((uint64_t)a + (uint64_t)b);
+    else if (op == SUB) *r = (int64_t)((uint64_t)a - (uint64_t)b);
+    else if (op == MUL) *r = (int64_t)((uint64_t)a * (uint64_t)b);
+    else if (op == DIV) *r = a / b;
+    else if (op == MOD) *r = a % b;
+    else return 0;
+    return 1;
+}
+
+// emit binary operator `op`, whose left operand was pushed by emit_push()
+// returning `left`. Two constant operands are folded into one IMM, a
+// constant right operand that is the identity of `op` is dropped together
+// with the PUSH, and multiplications by a power of two become shifts.
+// Divisions keep their DIV/MOD since a shift would round negative dividends
+// the wrong way.
+void emit_binary(int op, int64_t* left)
+{
+    int64_t b, r;
+    int k;
+
+    if (const_at == text - 1 && text[-2] == PUSH) {
+        b = *text;
+        if (left && left + 3 == const_at && fold(op, left[1], b, &r)) {
+            rewind_text(left + 1);
+            *text = r;
+            const_at = left;
+            return;
+        }
+        if (((op == ADD || op == SUB || op == OR || op == XOR || op == SHL || op == SHR) && b == 0) ||
+            ((op == MUL || op == DIV) && b == 1)) {
+            rewind_text(text - 3);
+            const_at = 0;
+            return;
+        }
+        if (op == MUL && b > 1 && !(b & (b - 1))) {
+            k = 0;
+            while (((int64_t)1 << k) != b) {
+                k++;
+            }
+            *text = k;
+            op = SHL;
+        }
+    }
+    *++text = op;
+}
+
+// expression stack depth at the end of text, the number of cells the code
+// of the current function has pushed beyond its locals
+int stack_depth()
+{
+    int64_t *p, op;
+    int depth;
+    depth = 0;
+    p = function_entry;
+    if (depth_at >= function_entry && depth_at <= text + 1) {
+        depth = depth_then;
+        p = depth_at;
+    }
+    while (p <= text) {
+        op = *p;
+        depth_at = p;
+        depth_then = depth;
+        if (op == PUSH) {
+            depth++;
+        } else if ((op >= OR && op <= MOD) || op == SI || op == SC) {
+            depth--;
+        } else if (op == ADJ) {
+            depth = depth - p[1];
+        }
+        p = p + 1 + op_operands(op);
+    }
+    return depth;
+}
+
+// inline a call to the function `id` whose `args` arguments have just been
+// pushed, including the ADJ that drops them. Returns 0 when the function is
+// not a small leaf function.
+//
+// The body runs on the caller's frame with the callee's bp offsets rebased
+// onto the caller's bp, as if CALL and ENT had pushed their two cells. When
+// the callee has locals, those two cells and the locals are reserved with
+// `ADJ -(2 + locals)`, and so are the two cells when the body addresses
+// below its bp, e.g. the argument of a call inlined into it. Every LEV but a
+// final one becomes a jump past the body.
+int emit_inline(int64_t* id, int args)
+{
+    int64_t *body, *end, *p, *map, *exit, op, base;
+    int locals, reserved, below;
+
+    body = (int64_t*)id[Value];
+    end = (int64_t*)id[Extent];
+    if (!inline_limit || !end || end - body > inline_limit || args != id[Params]) {
+        return 0;
+    }
+    // superinstructions, from an earlier compile into the same program, are
+    // not rebased
+    below = 0;
+    p = body;
+    while (p < end) {
+        if (*p == CALL || *p == TCALL || *p > EXIT) {
+            return 0;
+        }
+        if (*p == LEA && p[1] < 2) {
+            below = 1;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+
+    locals = body[1];
+    reserved = (locals || below) ? 2 + locals : 0;
+    base = -(function_entry[1] + stack_depth() + 2);
+    if (reserved) {
+        *++text = ADJ;
+        *++text = -reserved;
+    }
+
+    // lay out the copy, a LEV grows into `JMP exit`
+    map = malloc((end - body + 1) * sizeof(int64_t));
+    op = 0;
+    p = body + 2;
+    while (p < end) {
+        map[p - body] = op;
+        if (*p == LEV) {
+            op = op + ((p + 1 < end) ? 2 : 0);
+        } else {
+            op = op + 1 + op_operands(*p);
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    map[p - body] = op;
+    exit = text + 1 + op;
+
+    p = body + 2;
+    while (p < end) {
+        op = *p;
+        if (op == LEV) {
+            if (p + 1 < end) {
+                *++text = JMP;
+                *++text = (int64_t)exit;
+            }
+        } else {
+            *++text = op;
+            if (op == LEA) {
+                *++text = p[1] + base;
+            } else if (op_is_jump(op)) {
+                *++text = (int64_t)(exit - map[end - body] + map[(int64_t*)p[1] - body]);
+            } else if (op_operands(op)) {
+                *++text = p[1];
+            }
+        }
+        p = p + 1 + op_operands(op);
+    }
+    if (reserved + args > 0) {
+        *++text = ADJ;
+        *++text = reserved + args;
+    }
+    free(map);
+    return 1;
+}
+
 void expression(int level)
 {
     int64_t *id;
     int tmp;
     int64_t *addr;
+    int64_t *scale;
     {
         if (!token) {
             printf("%d: unexpected token EOF of expression\n", line);
@@ -431,16 +969,13 @@ void expression(int level)
             match(Num);
 
             // emit code
-            *++text = IMM;
-            *++text = token_val;
-            printf("code: IMM %ld\n", *text);
+            emit_constant(token_val);
             expr_type = INT;
         } else if (token == '"') {
             // continuous string "abc" "abc"
             // emit code
             *++text = IMM;
             *++text = token_val;
-            printf("code: IMM %ld\n", *text);
 
             match('"');
             // store the rest strings
@@ -472,9 +1007,7 @@ void expression(int level)
             match(')');
 
             // emit code
-            *++text = IMM;
-            *++text = (expr_type == CHAR) ? sizeof(char) : sizeof(int);
-            printf("code: IMM %ld\n", *text);
+            emit_constant((expr_type == CHAR) ? sizeof(char) : sizeof(int));
 
             expr_type = INT;
         } else if (token == Id) {
@@ -507,8 +1040,13 @@ void expression(int level)
                     *++text = id[Value];
                 } else if (id[Class] == Fun) {
                     // function call
-                    *++text = CALL;
-                    *++text = id[Value];
+                    if (emit_inline(id, tmp)) {
+                        tmp = 0;  // arguments already dropped
+                    } else {
+                        *++text = CALL;
+                        *++text = id[Value];
+                        call_at = text - 1;
+                    }
                 } else {
                     printf("%d: bad function call\n", line);
                     exit(-1);
@@ -517,25 +1055,20 @@ void expression(int level)
                 if (tmp > 0) {
                     *++text = ADJ;
                     *++text = tmp;
-                    printf("code: ADJ %ld\n", *text);
                 }
                 expr_type = id[Type];
             } else if (id[Class] == Num) {
                 // enum variable
-                *++text = IMM;
-                *++text = id[Value];
-                printf("code: IMM %ld\n", *text);
+                emit_constant(id[Value]);
                 expr_type = INT;
             } else {
                 // variable
                 if (id[Class] == Loc) {
                     *++text = LEA;
                     *++text = index_of_bp - id[Value];
-                    printf("code: LEA %ld\n", *text);
                 } else if (id[Class] == Glo) {
                     *++text = IMM;
                     *++text = id[Value];
-                    printf("code: IMM %ld\n", *text);
                 } else {
                     printf("%d: undefined variable\n", line);
                     exit(-1);
@@ -544,7 +1077,6 @@ void expression(int level)
                 // address which is stored in `ax`
                 expr_type = id[Type];
                 *++text = (expr_type == Char) ? LC : LI;
-                printf("code: LC\n");
             }
         } else if (token == '(') {
             // cast or paranthesis
@@ -577,13 +1109,15 @@ void expression(int level)
                 exit(-1);
             }
             *++text = (expr_type == CHAR) ? LC : LI;
-            printf("code: %s\n", *text == LC ? "LC" : "LI");
         } else if (token == And) {
             // get the address of
             match(And);
             expression(Inc);
             if (*text == LC || *text == LI) {
-                text--;
+                rewind_text(text - 1);
+                if (text[-1] == LEA) {
+                    frame_taken = 1;
+                }
             } else {
                 printf("%d: bad address of\n", line);
                 exit(-1);
@@ -595,10 +1129,9 @@ void expression(int level)
             expression(Inc);
 
             // emit code, use <expr> == 0
-            *++text = PUSH;
-            *++text = IMM;
-            *++text = 0;
-            *++text = EQ;
+            addr = emit_push();
+            emit_constant(0);
+            emit_binary(EQ, addr);
             expr_type = INT;
         } else if (token == '~') {
             // bitwise not
@@ -606,10 +1139,9 @@ void expression(int level)
             expression(Inc);
 
             // emit code, use <expr> XOR -1
-            *++text = PUSH;
-            *++text = IMM;
-            *++text = -1;
-            *++text = XOR;
+            addr = emit_push();
+            emit_constant(-1);
+            emit_binary(XOR, addr);
 
             expr_type = INT;
         } else if (token == Add) {
@@ -621,15 +1153,13 @@ void expression(int level)
             // -var
             match(Sub);
             if (token == Num) {
-                *++text = IMM;
-                *++text = -token_val;
+                emit_constant(-token_val);
                 match(Num);
             } else {
-                *++text = IMM;
-                *++text = -1;
-                *++text = PUSH;
+                emit_constant(-1);
+                addr = emit_push();
                 expression(Inc);
-                *++text = MUL;
+                emit_binary(MUL, addr);
             }
             expr_type = INT;
         } else if (token == Inc || token == Dec) {
@@ -693,6 +1223,7 @@ void expression(int level)
 
                 expression(Cond);
                 *addr = (intptr_t)(text + 1);
+                const_at = call_at = 0;
             } else if (token == Lor) {
                 // logic or
                 match(Lor);
@@ -702,6 +1233,7 @@ void expression(int level)
 
                 expression(Lan);
                 *addr = (intptr_t)(text + 1);
+                const_at = call_at = 0;
                 expr_type = INT;
             } else if (token == Lan) {
                 // logic and
@@ -713,158 +1245,156 @@ void expression(int level)
                 expression(Or);
 
                 *addr = (intptr_t)(text + 1);
+                const_at = call_at = 0;
                 expr_type = INT;
             } else if (token == Or) {
                 // bitwise or
                 match(Or);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Xor);
-                *++text = OR;
+                emit_binary(OR, addr);
                 expr_type = INT;
             } else if (token == Xor) {
                 // bitwise xor
                 match(Xor);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(And);
-                *++text = XOR;
+                emit_binary(XOR, addr);
                 expr_type = INT;
             } else if (token == And) {
                 // bitwise and
                 match(And);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Eq);
-                *++text = AND;
+                emit_binary(AND, addr);
                 expr_type = INT;
             } else if (token == Eq) {
                 // equal ==
                 match(Eq);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Ne);
-                *++text = EQ;
+                emit_binary(EQ, addr);
                 expr_type = INT;
             } else if (token == Ne) {
                 // not equal !=
                 match(Ne);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Lt);
-                *++text = NE;
+                emit_binary(NE, addr);
                 expr_type = INT;
             } else if (token == Lt) {
                 // less than
                 match(Lt);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Shl);
-                *++text = LT;
+                emit_binary(LT, addr);
                 expr_type = INT;
             } else if (token == Gt) {
                 // greater than
                 match(Gt);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Shl);
-                *++text = GT;
+                emit_binary(GT, addr);
                 expr_type = INT;
             } else if (token == Le) {
                 // less than or equal to
                 match(Le);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Shl);
-                *++text = LE;
+                emit_binary(LE, addr);
                 expr_type = INT;
             } else if (token == Ge) {
                 // greater than or equal to
                 match(Ge);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Shl);
-                *++text = GE;
+                emit_binary(GE, addr);
                 expr_type = INT;
             } else if (token == Shl) {
                 // shift left
                 match(Shl);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Add);
-                *++text = SHL;
+                emit_binary(SHL, addr);
                 expr_type = INT;
             } else if (token == Shr) {
                 // shift right
                 match(Shr);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Add);
-                *++text = SHR;
+                emit_binary(SHR, addr);
                 expr_type = INT;
             } else if (token == Add) {
                 // add
                 match(Add);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Mul);
 
                 expr_type = tmp;
                 if (expr_type > PTR) {
                     // pointer type, and not `char*`
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int64_t);
-                    *++text = MUL;
+                    scale = emit_push();
+                    emit_constant(sizeof(int64_t));
+                    emit_binary(MUL, scale);
                 }
-                *++text = ADD;
+                emit_binary(ADD, addr);
             } else if (token == Sub){
                 // Sub
                 match (Sub);
 
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Mul);
                 if (tmp > PTR && tmp == expr_type) {
                     // pointer subtraction
-                    *++text = SUB;
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int64_t);
-                    *++text = DIV;
+                    emit_binary(SUB, addr);
+                    scale = emit_push();
+                    emit_constant(sizeof(int64_t));
+                    emit_binary(DIV, scale);
                     expr_type = INT;
                 } else if (tmp > PTR) {
                     // pointer movement
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int64_t);
-                    *++text = MUL;
-                    *++text = SUB;
+                    scale = emit_push();
+                    emit_constant(sizeof(int64_t));
+                    emit_binary(MUL, scale);
+                    emit_binary(SUB, addr);
                     expr_type = tmp;
                 } else {
                     // numeral subtraction
-                    *++text = SUB;
+                    emit_binary(SUB, addr);
                     expr_type = tmp;
                 }
             } else if (token == Mul) {
                 // multiply
                 match(Mul);
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Inc);
-                *++text = MUL;
+                emit_binary(MUL, addr);
                 expr_type = tmp;
             } else if (token == Div) {
                 // divide
                 match(Div);
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Inc);
-                *++text = DIV;
+                emit_binary(DIV, addr);
                 expr_type = tmp;
             } else if (token == Mod) {
                 // Modulo
                 match(Mod);
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Inc);
-                *++text = MOD;
+                emit_binary(MOD, addr);
                 expr_type = tmp;
             } else if (token == Inc || token == Dec) {
                 // postfix inc(++) and dec(--)
@@ -896,23 +1426,22 @@ void expression(int level)
             } else if (token == Brak) {
                 // array access var[xx]
                 match(Brak);
-                *++text = PUSH;
+                addr = emit_push();
                 expression(Assign);
                 match(']');
 
                 if (tmp > PTR) {
                     // pointer, `not char *`
-                    *++text = PUSH;
-                    *++text = IMM;
-                    *++text = sizeof(int64_t);
-                    *++text = MUL;
+                    scale = emit_push();
+                    emit_constant(sizeof(int64_t));
+                    emit_binary(MUL, scale);
                 }
                 else if (tmp < PTR) {
                     printf("%d: pointer type expected\n", line);
                     exit(-1);
                 }
                 expr_type = tmp - PTR;
-                *++text = ADD;
+                emit_binary(ADD, addr);
                 *++text = (expr_type == CHAR) ? LC : LI;
             } else {
                 printf("%d: compiler error, token = %d\n", line, token);
@@ -922,6 +1451,58 @@ void expression(int level)
     }
 }
 
+// note the call that the expression of a return statement ends with, if it
+// can become a tail call. Only calls passing as many arguments as the current
+// function has parameters qualify: the caller's ADJ drops exactly those cells.
+void note_tail_call()
+{
+    int64_t args;
+
+    if (call_at && call_at == text - 1) {
+        args = 0;
+    } else if (call_at && call_at == text - 3 && text[-1] == ADJ) {
+        args = *text;
+    } else {
+        return;
+    }
+    if (args != index_of_bp - 1) {
+        return;
+    }
+    if (tail_count == tail_size) {
+        tail_size = tail_size * 2 + 64;
+        if (!(tail_calls = realloc(tail_calls, tail_size * sizeof(int64_t*)))) {
+            printf("could not malloc(%ld) for tail calls\n", tail_size * sizeof(int64_t*));
+            exit(-1);
+        }
+    }
+    tail_calls[tail_count++] = call_at;
+    call_at = 0;
+}
+
+// at the end of a function, turn each noted `CALL <addr> [ADJ <args>] LEV`
+// into `TCALL <addr> <args>`, which replaces the current frame by the
+// callee's, so the callee returns straight to our caller. That is only
+// known to be safe once the whole body is compiled: a `&` anywhere in it,
+// even after the return, may leave a pointer into the frame. The cells
+// TCALL leaves over keep their LEV, which is never reached.
+void emit_tail_calls()
+{
+    int64_t* p;
+
+    while (tail_count > 0) {
+        p = tail_calls[--tail_count];
+        if (!frame_taken) {
+            p[0] = TCALL;
+            if (p[2] == ADJ) {
+                p[2] = p[3];
+                p[3] = LEV;
+            } else {
+                p[2] = 0;
+            }
+        }
+    }
+}
+
 void statement()
 {
     // there are 6 kinds of statements here:
@@ -964,6 +1545,7 @@ void statement()
             // +1 => label b address
             // +1 => first op instr in 'else' statement
             *b = (int64_t)(text + 3);
+            const_at = 0;
             // emit code for JMP b
             *++text = JMP;
             b = ++text;  // pointing to label b
@@ -971,6 +1553,7 @@ void statement()
             statement();
         }
         *b = (int64_t)(text + 1);  // now, we know label b
+        const_at = 0;
     }
     else if (token == While) {
         // a:                   a:
@@ -995,6 +1578,7 @@ void statement()
         *++text = JMP;
         *++text = (int64_t)a;
         *b = (int64_t)(text + 1);
+        const_at = 0;
     } else if (token == '{') {
         // { <statement> ... }
         match('{');
@@ -1007,12 +1591,14 @@ void statement()
     } else if (token == Return) {
         // return [<expression>] ;
         match(token);
+        call_at = 0;
         if (token != ';') {
             expression(Assign);
         }
         match(';');
 
         // emit code for return
+        note_tail_call();
         *++text = LEV;
     } else if (token == ';') {
         // empty statement
@@ -1056,6 +1642,7 @@ void function_parameter()
 
         match(Id);
         // store the local variable
+        scope[scope_top++] = current_id;
         current_id[BClass] = current_id[Class];
         current_id[Class] = Loc;
         current_id[BType] = current_id[Type];
@@ -1104,6 +1691,7 @@ void function_body()
             match(Id);
 
             // store the local variable
+            scope[scope_top++] = current_id;
             current_id[BClass] = current_id[Class];
             current_id[Class] = Loc;
             current_id[BType] = current_id[Type];
@@ -1119,6 +1707,10 @@ void function_body()
     }
 
     // save the stack size for local variables
+    function_entry = text + 1;
+    frame_taken = 0;
+    tail_count = 0;
+    depth_at = 0;
     *++text = ENT;
     *++text = pos_local - index_of_bp;
 
@@ -1129,6 +1721,18 @@ void function_body()
 
     // emit code for leaving the sub function
     *++text = LEV;
+    emit_tail_calls();
+}
+
+// unwind local variable declarations, the ones recorded on the scope stack
+void scope_unwind()
+{
+    while (scope_top > 0) {
+        current_id = scope[--scope_top];
+        current_id[Class] = current_id[BClass];
+        current_id[Type] = current_id[BType];
+        current_id[Value] = current_id[BValue];
+    }
 }
 
 void function_declaration()
@@ -1137,20 +1741,14 @@ void function_declaration()
     match('(');
     function_parameter();
     match(')');
-    match('{');
-    function_body();
-    // match('}');  // later someone will consume it
-
-    // unwind local variable declarations for all local variables
-    current_id = symbols;
-    while (current_id[Token]) {
-        if (current_id[Class] == Loc) {
-            current_id[Class] = current_id[BClass];
-            current_id[Type] = current_id[BType];
-            current_id[Value] = current_id[BValue];
-        }
-        current_id = current_id + IdSize;
+    // a prototype ends at the ';', which the caller consumes
+    if (token != ';') {
+        match('{');
+        function_body();
+        // match('}');  // later someone will consume it
     }
+
+    scope_unwind();
 }
 
 void enum_declaration()
@@ -1188,6 +1786,11 @@ void enum_declaration()
 
 }
 
+// the function whose definition is being compiled and the JMP stub of its
+// prototype, if any, for the library to take back a definition that a
+// compile error cut short
+int64_t *defining, *defining_stub;
+
 void global_declaration()
 {
     // global_declaration ::= enum_decl | variable_decl | function_decl
@@ -1196,9 +1799,11 @@ void global_declaration()
     //
     // variable_decl ::= type {'*'} id { ',' {'*'} id } ';'
     //
-    // function_decl ::= type {'*'} id '(' parameter_decl ')' '{' body_decl '}'
+    // function_decl ::= type {'*'} id '(' parameter_decl ')' ('{' body_decl '}' | ';')
     int type;  // tmp, actual type for variable
     int i;  // tmp
+    int64_t* id;
+    int64_t* stub;  // the JMP stub of a function declared by a prototype
     basetype = INT;
 
     // parse enum, this should be treated alone
@@ -1244,7 +1849,9 @@ void global_declaration()
             printf("%d: bad global declaration\n", line);
             exit(-1);
         }
-        if (current_id[Class]) {
+        // only a function declared by a prototype may be declared again
+        stub = (current_id[Class] == Fun && !current_id[Extent]) ? (int64_t*)current_id[Value] : 0;
+        if (current_id[Class] && !stub) {
             // identifier exists
             printf("%d: duplicate global declaration\n", line);
             exit(-1);
@@ -1257,8 +1864,30 @@ void global_declaration()
         if (token == '(') {
             current_id[Class] = Fun;
             current_id[Value] = (int64_t)(text + 1);  // the memory address
+            id = current_id;
+            defining = id;
+            defining_stub = stub;
             function_declaration();
-        } else {  // 否则就是变量声明或者定义
+            defining = 0;
+            id[Params] = index_of_bp - 1;
+            if (token != ';') {
+                id[Extent] = (int64_t)(text + 1);
+                if (stub) {
+                    stub[1] = id[Value];
+                }
+            } else if (stub) {
+                id[Value] = (int64_t)stub;
+            } else {
+                // a prototype: calls go through a `JMP` stub that the
+                // definition, or the linker, points at the function
+                id[Value] = (int64_t)(text + 1);
+                *++text = JMP;
+                *++text = id[Value];
+            }
+        } else if (stub) {
+            printf("%d: duplicate global declaration\n", line);
+            exit(-1);
+        } else {  // 否则就是变量声明或者定义
             // variable declaration
             current_id[Class] = Glo;  // global variable
             current_id[Value] = (int64_t)data;  // assign memory address
@@ -1280,11 +1909,706 @@ void program()
     }
 }
 
-int eval()
+// flag the cells of the text segment that control can enter other than by
+// falling through: jump and call targets, and function entries.
+// Indexed by offset from `old_text`, the caller frees the result.
+char* text_leaders()
+{
+    char* leader;
+    int64_t* p;
+    int64_t* id;
+
+    leader = calloc(text - old_text + 2, 1);
+    p = old_text + 1;
+    while (p <= text) {
+        if (op_is_jump(*p)) {
+            leader[(int64_t*)p[1] - old_text] = 1;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun) {
+            leader[(int64_t*)id[Value] - old_text] = 1;
+        }
+        id = id + IdSize;
+    }
+    return leader;
+}
+
+// install a rewritten text segment. `code` holds the new instructions at the
+// same offsets they will have in text, `end` is its last cell and `map[i]` is
+// the new offset of the instruction that was at offset i. Jump operands are
+// still old addresses and are translated here, as are function entries.
+void text_install(int64_t* code, int64_t* end, int64_t* map)
+{
+    int64_t* p;
+    int64_t* id;
+    int* lines;
+
+    p = code + 1;
+    while (p <= end) {
+        if (op_is_jump(*p)) {
+            p[1] = (int64_t)(old_text + map[(int64_t*)p[1] - old_text]);
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun) {
+            id[Value] = (int64_t)(old_text + map[(int64_t*)id[Value] - old_text]);
+            if (id[Extent]) {
+                id[Extent] = (int64_t)(old_text + map[(int64_t*)id[Extent] - old_text]);
+            }
+        }
+        id = id + IdSize;
+    }
+    // an instruction merged with or dropped before the next one leaves the
+    // line of the last of them
+    if (text_line) {
+        lines = calloc(text - old_text + 2, sizeof(int));
+        p = old_text + 1;
+        while (p <= text) {
+            lines[map[p - old_text]] = text_line[p - old_text];
+            p = p + 1 + op_operands(*p);
+        }
+        memcpy(text_line, lines, (text - old_text + 2) * sizeof(int));
+        free(lines);
+    }
+    memcpy(old_text + 1, code + 1, (end - code) * sizeof(int64_t));
+    text = old_text + (end - code);
+}
+
+// start a rewrite of the text from `from` on: the cells before it are
+// copied to `code` as they are, at offsets mapped to themselves, so that
+// text_install() leaves them in place. Returns the last cell copied.
+int64_t* text_keep(int64_t* code, int64_t* map, int64_t* from)
+{
+    int64_t i;
+
+    i = 1;
+    while (i < from - old_text) {
+        code[i] = old_text[i];
+        map[i] = i;
+        i++;
+    }
+    return code + i - 1;
+}
+
+// control flow pass run after program() on the text from `from` on, the
+// code compiled before it stays where it is: thread jumps to their final
+// targets, resolve conditional jumps on constants, then drop the code that
+// cannot be reached from any function entry and compact the text segment.
+void optimize_jumps(int64_t* from)
+{
+    char *leader, *live;
+    int64_t *code, *map, *work, *p, *q, *t, op;
+    int64_t n, top, hops;
+    int64_t* id;
+    int dead;
+
+    leader = text_leaders();
+    n = text - old_text + 2;
+
+    // conditional jumps after a constant that no other path reaches
+    p = from;
+    q = 0;  // previous instruction
+    while (p <= text) {
+        if ((*p == JZ || *p == JNZ) && q && *q == IMM && !leader[p - old_text]) {
+            if ((*p == JZ) == (q[1] == 0)) {
+                *p = JMP;
+            } else {
+                // never taken, becomes a jump to the next instruction
+                p[1] = (int64_t)(p + 2);
+            }
+        }
+        q = p;
+        p = p + 1 + op_operands(*p);
+    }
+
+    // jump threading, a jump to a jump goes to the final target instead
+    p = from;
+    while (p <= text) {
+        if (*p == JMP || *p == JZ || *p == JNZ) {
+            t = (int64_t*)p[1];
+            hops = 0;
+            while (*t == JMP && (int64_t*)t[1] != t && hops++ < 16) {
+                t = (int64_t*)t[1];
+            }
+            p[1] = (int64_t)t;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+
+    // reachability from the function entries
+    live = calloc(n, 1);
+    work = malloc(n * sizeof(int64_t));
+    top = 0;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun && (int64_t*)id[Value] >= from) {
+            work[top++] = (int64_t*)id[Value] - old_text;
+        }
+        id = id + IdSize;
+    }
+    while (top > 0) {
+        p = old_text + work[--top];
+        while (p >= from && p <= text && !live[p - old_text]) {
+            live[p - old_text] = 1;
+            op = *p;
+            if (op_is_jump(op)) {
+                work[top++] = (int64_t*)p[1] - old_text;
+            }
+            if (op == JMP || op == LEV || op == TCALL || op == EXIT) {
+                break;
+            }
+            p = p + 1 + op_operands(op);
+        }
+    }
+
+    // compact, jumps over nothing but dead code disappear
+    code = malloc(n * sizeof(int64_t));
+    map = malloc(n * sizeof(int64_t));
+    q = text_keep(code, map, from);
+    p = from;
+    while (p <= text) {
+        op = *p;
+        map[p - old_text] = q + 1 - code;
+        dead = 0;
+        if (op == JMP || op == JZ || op == JNZ) {
+            t = p + 2;
+            while (t < (int64_t*)p[1] && !live[t - old_text]) {
+                t = t + 1 + op_operands(*t);
+            }
+            dead = (t == (int64_t*)p[1]);
+        }
+        if (live[p - old_text] && !dead) {
+            memcpy(q + 1, p, (1 + op_operands(op)) * sizeof(int64_t));
+            q = q + 1 + op_operands(op);
+        }
+        p = p + 1 + op_operands(op);
+    }
+    map[p - old_text] = q + 1 - code;
+    text_install(code, q, map);
+    free(code);
+    free(map);
+    free(work);
+    free(live);
+    free(leader);
+}
+
+// superinstruction table, longest patterns first. The patterns are the most
+// frequent opcode sequences emitted by expression(); regenerate the table from
+// opcode pair frequency profiles when the code generator changes. A fused
+// instruction takes the operands of its parts in order.
+struct {
+    int64_t fused;
+    int64_t ops[3];
+    int len;
+} superinstruction[] = {
+    { LLIP, { LEA, LI, PUSH }, 3 },
+    { ADDI, { PUSH, IMM, ADD }, 3 },
+    { SUBI, { PUSH, IMM, SUB }, 3 },
+    { MULI, { PUSH, IMM, MUL }, 3 },
+    { LTI,  { PUSH, IMM, LT }, 3 },
+    { LLI,  { LEA, LI }, 2 },
+    { LEAP, { LEA, PUSH }, 2 },
+    { IMMP, { IMM, PUSH }, 2 },
+    { LIP,  { LI, PUSH }, 2 },
+    { 0, { 0 }, 0 }
+};
+
+// index in `superinstruction` of the first pattern of at most `len`
+// instructions that matches at p, or of the terminating entry
+int superinstruction_at(int64_t* p, int len, char* leader)
+{
+    int64_t* r;
+    int i, j;
+    i = 0;
+    while (superinstruction[i].len) {
+        r = p;
+        j = 0;
+        while (superinstruction[i].len <= len && j < superinstruction[i].len && r <= text &&
+               *r == superinstruction[i].ops[j] && (j == 0 || !leader[r - old_text])) {
+            r = r + 1 + op_operands(*r);
+            j++;
+        }
+        if (j == superinstruction[i].len) {
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+// peephole pass run after program() on the text from `from` on: rewrite the
+// sequences listed in `superinstruction` into fused instructions, saving a
+// dispatch and usually a stack round trip for each. A sequence is only fused
+// when no jump enters it past its first instruction. A match gives up its
+// last instruction to a three instruction pattern starting there, so that
+// `LEA; LI; PUSH; IMM; SUB` becomes LLI; SUBI rather than LLIP; IMM; SUB.
+void fuse_superinstructions(int64_t* from)
+{
+    char* leader;
+    int64_t *code, *map, *p, *q, *r;
+    int i, j, k;
+
+    leader = text_leaders();
+    code = malloc((text - old_text + 1) * sizeof(int64_t));
+    map = malloc((text - old_text + 2) * sizeof(int64_t));
+    q = text_keep(code, map, from);
+    p = from;
+    while (p <= text) {
+        map[p - old_text] = q + 1 - code;
+        i = superinstruction_at(p, 3, leader);
+        if (superinstruction[i].len) {
+            r = p;
+            j = 1;
+            while (j < superinstruction[i].len) {
+                r = r + 1 + op_operands(*r);
+                j++;
+            }
+            if (superinstruction[superinstruction_at(r, 3, leader)].len == 3) {
+                i = superinstruction_at(p, superinstruction[i].len - 1, leader);
+            }
+        }
+        if (superinstruction[i].len) {
+            *++q = superinstruction[i].fused;
+            j = 0;
+            while (j < superinstruction[i].len) {
+                map[p - old_text] = q - code;
+                k = op_operands(*p);
+                p++;
+                while (k-- > 0) {
+                    *++q = *p++;
+                }
+                j++;
+            }
+        } else {
+            k = op_operands(*p);
+            *++q = *p++;
+            while (k-- > 0) {
+                *++q = *p++;
+            }
+        }
+    }
+    map[p - old_text] = q + 1 - code;
+    text_install(code, q, map);
+    free(code);
+    free(map);
+    free(leader);
+}
+
+// length of the name of an identifier, names point into the source
+int id_length(int64_t* id)
+{
+    char* p;
+    p = (char*)id[Name];
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+        (*p >= '0' && *p <= '9') || (*p == '_')) {
+        p++;
+    }
+    return p - (char*)id[Name];
+}
+
+// execution profile, filled by eval_counted() when `profiling` is set:
+// `cycle` counts every instruction, prof_pc the instructions executed at each
+// text offset and prof_pair each opcode followed by the next one
+int profiling;
+int stats;  // print the instruction count at EXIT
+int64_t* prof_pc;
+int64_t prof_op[LTI + 1];
+int64_t prof_pair[LTI + 1][LTI + 1];
+int64_t prof_last;  // previous opcode, -1 before the first
+
+void profile_start()
+{
+    prof_pc = calloc(text - old_text + 1, sizeof(int64_t));
+    prof_last = -1;
+    cycle = 0;
+}
+
+int profile_by_count(const void* a, const void* b)
+{
+    int64_t x, y;
+    x = **(int64_t**)a;
+    y = **(int64_t**)b;
+    return (x < y) - (x > y);
+}
+
+// print the profile to stderr, every table sorted by count
+void profile_report()
+{
+    int64_t **order, *id, *p, *count;
+    int64_t n, i, j;
+
+    // `order` sorts the opcode pairs, then the functions
+    n = symbols_size / sizeof(int64_t) / IdSize + 1;
+    if (n < (LTI + 1) * (LTI + 1) + 1) {
+        n = (LTI + 1) * (LTI + 1) + 1;
+    }
+    order = malloc(n * sizeof(int64_t*));
+    fprintf(stderr, "\nprofile: %ld instructions\n", cycle);
+
+    fprintf(stderr, "\n%-8s %14s %7s\n", "opcode", "count", "%");
+    n = 0;
+    i = 0;
+    while (i <= LTI) {
+        if (prof_op[i]) {
+            order[n++] = &prof_op[i];
+        }
+        i++;
+    }
+    qsort(order, n, sizeof(int64_t*), profile_by_count);
+    i = 0;
+    while (i < n) {
+        fprintf(stderr, "%-8s %14ld %6.2f%%\n", op_name[order[i] - prof_op], *order[i],
+                100.0 * *order[i] / cycle);
+        i++;
+    }
+
+    // the most frequent pairs are the candidates for `superinstruction`
+    fprintf(stderr, "\n%-14s %14s %7s\n", "opcode pair", "count", "%");
+    n = 0;
+    i = 0;
+    while (i <= LTI) {
+        j = 0;
+        while (j <= LTI) {
+            if (prof_pair[i][j]) {
+                order[n++] = &prof_pair[i][j];
+            }
+            j++;
+        }
+        i++;
+    }
+    qsort(order, n, sizeof(int64_t*), profile_by_count);
+    i = 0;
+    while (i < n && i < 20) {
+        j = order[i] - &prof_pair[0][0];
+        fprintf(stderr, "%-6s %-7s %14ld %6.2f%%\n", op_name[j / (LTI + 1)],
+                op_name[j % (LTI + 1)], *order[i], 100.0 * *order[i] / cycle);
+        i++;
+    }
+
+    // instructions executed in each function, from its entry to its extent,
+    // `count` is indexed like the symbol table
+    count = calloc(symbols_size / sizeof(int64_t) / IdSize + 1, sizeof(int64_t));
+    n = 0;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun) {
+            i = (id - symbols) / IdSize;
+            p = (int64_t*)id[Value];
+            while (p < (int64_t*)id[Extent]) {
+                count[i] = count[i] + prof_pc[p++ - old_text];
+            }
+            if (count[i]) {
+                order[n++] = &count[i];
+            }
+        }
+        id = id + IdSize;
+    }
+    qsort(order, n, sizeof(int64_t*), profile_by_count);
+    fprintf(stderr, "\n%-20s %14s %7s\n", "function", "count", "%");
+    i = 0;
+    while (i < n) {
+        id = symbols + (order[i] - count) * IdSize;
+        fprintf(stderr, "%-20.*s %14ld %6.2f%%\n", id_length(id), (char*)id[Name], *order[i],
+                100.0 * *order[i] / cycle);
+        i++;
+    }
+    free(count);
+    free(order);
+}
+
+// sampling profiler. SIGPROF only raises `prof_tick`; eval_counted() takes
+// the sample at the next instruction boundary by walking the frame chain,
+// where bp[0] is the caller's bp and bp[1] the return address. Samples are
+// kept as folded stacks, `main:12;walk:30;visit:41`, each frame being a
+// function and the line it is executing, in an open addressing table of
+// `sample_size`.
+volatile sig_atomic_t prof_tick;
+char* sample_path;  // where the folded stacks are written at EXIT
+char** sample_stack;
+int64_t* sample_count;
+int sample_size;
+
+void sample_signal(int sig)
+{
+    prof_tick = 1;
+}
+
+// start the SIGPROF timer, every `usec` microseconds of CPU time
+void sample_start(int usec)
+{
+    struct itimerval timer;
+
+    sample_size = 1 << 16;
+    sample_stack = calloc(sample_size, sizeof(char*));
+    sample_count = calloc(sample_size, sizeof(int64_t));
+    signal(SIGPROF, sample_signal);
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = usec;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, 0);
+}
+
+// the function whose code contains `addr`, 0 if there is none
+int64_t* function_containing(int64_t* addr)
+{
+    int64_t* id;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun && (int64_t*)id[Value] <= addr && addr < (int64_t*)id[Extent]) {
+            return id;
+        }
+        id = id + IdSize;
+    }
+    return 0;
+}
+
+void sample_take(int64_t* pc, int64_t* bp)
+{
+    int64_t *frame[256], *top, *id;
+    char buf[8192];
+    int n, len;
+    unsigned hash, i;
+
+    // the executing instruction, then the CALL of each frame
+    top = (int64_t*)((char*)stack + stack_size);
+    n = 0;
+    frame[n++] = pc;
+    while (n < 256 && bp >= stack && bp < top &&
+           (int64_t*)bp[1] > old_text + 2 && (int64_t*)bp[1] <= text) {
+        frame[n++] = (int64_t*)bp[1] - 2;
+        bp = (int64_t*)bp[0];
+    }
+
+    len = 0;
+    while (n-- > 0 && len < sizeof(buf) - 128) {
+        if ((id = function_containing(frame[n]))) {
+            len = len + sprintf(buf + len, "%s%.*s:%d", len ? ";" : "", id_length(id),
+                                (char*)id[Name], text_line ? text_line[frame[n] - old_text] : 0);
+        }
+    }
+    if (!len) {
+        return;  // in the startup stub
+    }
+
+    hash = 5381;
+    i = 0;
+    while (i < len) {
+        hash = hash * 33 + buf[i++];
+    }
+    i = hash & (sample_size - 1);
+    n = 0;
+    while (sample_stack[i] && strcmp(sample_stack[i], buf)) {
+        i = (i + 1) & (sample_size - 1);
+        if (++n == sample_size) {
+            return;  // table full
+        }
+    }
+    if (!sample_stack[i]) {
+        sample_stack[i] = strdup(buf);
+    }
+    sample_count[i]++;
+}
+
+// stop the timer and write the samples in folded stack format, one
+// `stack count` line per distinct stack, as flamegraph.pl reads it
+void sample_write()
+{
+    struct itimerval timer;
+    FILE* out;
+    int i;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+    if (!(out = fopen(sample_path, "w"))) {
+        printf("could not open(%s)\n", sample_path);
+        return;
+    }
+    i = 0;
+    while (i < sample_size) {
+        if (sample_stack[i]) {
+            fprintf(out, "%s %ld\n", sample_stack[i], sample_count[i]);
+        }
+        i++;
+    }
+    fclose(out);
+}
+
+// VM heap behind malloc() and free(): blocks of up to HEAP_MAX bytes are
+// rounded up to a size class and carved from 1MB chunks with a bump pointer,
+// freed blocks go to the free list of their class for the next malloc() of
+// that class. A cell before each block holds its class, or -1 for a larger
+// block, which comes from the C library and is kept on the `large` list.
+// arena_reset() frees every block at once: the free lists and the large
+// blocks go, and the chunks are bumped again from the first one.
+//
+// Each thread has its own heap, so batch workers do not share one.
+#define HEAP_CHUNK (1 << 20)
+#define HEAP_MAX 4096
+#define HEAP_CLASSES 16
+int64_t heap_size[HEAP_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+unsigned char heap_class[HEAP_MAX / 16 + 1];  // the class of each size, in 16 byte steps
+
+struct heap {
+    char* free[HEAP_CLASSES];  // free blocks, linked through their first cell
+    char* chunks;  // the first chunk, chunks are linked through their first cell
+    char* chunk;  // the chunk being bumped
+    char *pos, *end;
+    int64_t* large;  // blocks over HEAP_MAX, as `prev, next, -1, data...`
+};
+#if defined(__GNUC__)
+__thread
+#endif
+struct heap heap;
+
+void heap_init()
+{
+    int i, c;
+    c = 0;
+    i = 0;
+    while (i <= HEAP_MAX / 16) {
+        while (heap_size[c] < i * 16) {
+            c++;
+        }
+        heap_class[i] = c;
+        i++;
+    }
+}
+
+void* heap_alloc(int64_t n)
+{
+    int64_t* large;
+    char* p;
+    int c;
+
+    if (n < 0) {
+        return 0;
+    }
+    if (n > HEAP_MAX) {
+        if (!(large = malloc(n + 3 * sizeof(int64_t)))) {
+            return 0;
+        }
+        large[0] = 0;
+        large[1] = (int64_t)heap.large;
+        large[2] = -1;
+        if (heap.large) {
+            heap.large[0] = (int64_t)large;
+        }
+        heap.large = large;
+        return large + 3;
+    }
+    c = heap_class[(n + 15) >> 4];
+    if ((p = heap.free[c])) {
+        heap.free[c] = *(char**)p;
+        return p;
+    }
+    if (heap.pos + sizeof(int64_t) + heap_size[c] > heap.end) {
+        // the next chunk, the first cell links it to the one after
+        p = heap.chunk ? *(char**)heap.chunk : heap.chunks;
+        if (!p) {
+            p = mmap(0, HEAP_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return 0;
+            }
+            *(char**)p = 0;
+            if (heap.chunk) {
+                *(char**)heap.chunk = p;
+            } else {
+                heap.chunks = p;
+            }
+        }
+        heap.chunk = p;
+        heap.pos = p + sizeof(char*);
+        heap.end = p + HEAP_CHUNK;
+    }
+    *(int64_t*)heap.pos = c;
+    p = heap.pos + sizeof(int64_t);
+    heap.pos = p + heap_size[c];
+    return p;
+}
+
+void heap_free(void* p)
+{
+    int64_t* large;
+    int64_t c;
+
+    if (!p) {
+        return;
+    }
+    c = ((int64_t*)p)[-1];
+    if (c < 0) {
+        large = (int64_t*)p - 3;
+        if (large[0]) {
+            ((int64_t*)large[0])[1] = large[1];
+        } else {
+            heap.large = (int64_t*)large[1];
+        }
+        if (large[1]) {
+            ((int64_t*)large[1])[0] = large[0];
+        }
+        free(large);
+        return;
+    }
+    *(char**)p = heap.free[c];
+    heap.free[c] = p;
+}
+
+// free every block; the chunks are kept for reuse, or unmapped on `release`
+void heap_reset(int release)
+{
+    int64_t* large;
+    char* p;
+    int c;
+
+    while ((large = heap.large)) {
+        heap.large = (int64_t*)large[1];
+        free(large);
+    }
+    c = 0;
+    while (c < HEAP_CLASSES) {
+        heap.free[c++] = 0;
+    }
+    while (release && (p = heap.chunks)) {
+        heap.chunks = *(char**)p;
+        munmap(p, HEAP_CHUNK);
+    }
+    heap.chunk = 0;
+    heap.pos = heap.end = 0;
+}
+
+// the loop of eval() and eval_counted(). `counting` is a constant at both
+// calls, so the default loop is compiled without the bookkeeping of --stats,
+// --profile and --sample
+#if defined(__GNUC__)
+__attribute__((always_inline))
+#endif
+static inline int eval_loop(int counting)
 {
     int64_t op;
     int64_t* tmp;
+    int i;
     while (1) {
+        if (counting) {
+            if (prof_tick) {
+                prof_tick = 0;
+                sample_take(pc, bp);
+            }
+            cycle++;
+            if (profiling) {
+                prof_pc[pc - old_text]++;
+                prof_op[*pc]++;
+                if (prof_last >= 0) {
+                    prof_pair[prof_last][*pc]++;
+                }
+                prof_last = *pc;
+            }
+        }
         op = *pc++; // get next operation code
         switch (op) {
         // IMM (<-- pc)
@@ -1337,6 +2661,19 @@ int eval()
             *--sp = (int64_t)(pc + 1);
             pc = (int64_t*)*pc;
             break;
+        }
+            // TCALL <addr> <num of args> (<-- pc)
+            // the arguments replace those of the current frame, whose return
+            // address and old bp are handed on to the callee's ENT
+        case TCALL: {
+            i = pc[1];
+            while (i-- > 0) {
+                bp[2 + i] = sp[i];
+            }
+            sp = bp + 1;
+            bp = (int64_t*)*bp;
+            pc = (int64_t*)*pc;
+            break;
         }
             // ENT <num of int> (<-- pc)
         case ENT: {
@@ -1436,9 +2773,55 @@ int eval()
             break;
         }
 
+            // superinstructions
+        case LLIP: {
+            *--sp = ax = *(bp + *pc++);
+            break;
+        }
+        case LLI: {
+            ax = *(bp + *pc++);
+            break;
+        }
+        case LEAP: {
+            *--sp = ax = (int64_t)(bp + *pc++);
+            break;
+        }
+        case LIP: {
+            *--sp = ax = *(int64_t*)ax;
+            break;
+        }
+        case IMMP: {
+            *--sp = ax = *pc++;
+            break;
+        }
+        case ADDI: {
+            ax = ax + *pc++;
+            break;
+        }
+        case SUBI: {
+            ax = ax - *pc++;
+            break;
+        }
+        case MULI: {
+            ax = ax * *pc++;
+            break;
+        }
+        case LTI: {
+            ax = ax < *pc++;
+            break;
+        }
+
             // helper operations
         case EXIT: {
-            printf("exit(%ld)", *sp);
+            if (profiling) {
+                profile_report();
+            }
+            if (sample_path) {
+                sample_write();
+            }
+            if (stats) {
+                fprintf(stderr, "instructions: %ld\n", cycle);
+            }
             return *sp;
         }
         case OPEN: {
@@ -1459,7 +2842,11 @@ int eval()
             break;
         }
         case MALC: {
-            ax = (int64_t)malloc(*sp);
+            ax = (int64_t)heap_alloc(*sp);
+            break;
+        }
+        case FREE: {
+            heap_free((void*)*sp);
             break;
         }
         case MSET: {
@@ -1470,6 +2857,10 @@ int eval()
             ax = memcmp((char*)sp[2], (char*)sp[1], *sp);
             break;
         }
+        case ARST: {
+            heap_reset(0);
+            break;
+        }
         default: {
             printf("unknown instruction: %d\n", op);
             return -1;
@@ -1479,107 +2870,2656 @@ int eval()
     return 0;
 }
 
-int main(int argc, char** argv)
+int eval()
 {
-    int i, fd;
-    int64_t* tmp;
-
-    argc--;
-    argv++;
+    return eval_loop(0);
+}
 
-    poolsize = 256 * 1024;
-    line = 1;
+// eval() counting `cycle`, filling the profile and taking the samples
+int eval_counted()
+{
+    return eval_loop(1);
+}
 
-    // allocate memory for virtual
-    if (!(text = old_text = malloc(poolsize))) {
-        printf("could not malloc(%d) for text area\n", poolsize);
-        return -1;
-    }
-    if (!(data = malloc(poolsize))) {
-        printf("could not malloc(%d) for data area\n", poolsize);
-        return -1;
-    }
-    if (!(stack = malloc(poolsize))) {
-        printf("could not malloc(%d) for stack area\n", poolsize);
-        return -1;
-    }
-    if (!(symbols = malloc(poolsize))) {
-        printf("could not malloc(%d) for symbol table\n", poolsize);
-        return -1;
-    }
+#if defined(__GNUC__)
+void** threaded_handler;  // the handler of each opcode in eval_threaded()
 
-    memset(text, 0, poolsize);
-    memset(data, 0, poolsize);
-    memset(stack, 0, poolsize);
-    memset(symbols, 0, poolsize);
+// direct threaded dispatch: threaded_code() makes a copy of the text segment
+// in which every opcode is replaced by the address of its handler and every
+// jump operand is rebased onto the copy, so each handler ends with a single
+// indirect jump. The virtual machine registers are kept in locals (the
+// parameters shadow the globals) so they stay in host registers across the
+// library calls. printf() writes to `out`. A call without `pc` only sets
+// threaded_handler.
+int64_t eval_threaded(int64_t* pc, int64_t* sp, int64_t* bp, FILE* out)
+{
+    static void* handler[] = {
+        [LEA] = &&op_lea, [IMM] = &&op_imm, [JMP] = &&op_jmp, [CALL] = &&op_call,
+        [JZ] = &&op_jz, [JNZ] = &&op_jnz, [ENT] = &&op_ent, [ADJ] = &&op_adj,
+        [LEV] = &&op_lev, [TCALL] = &&op_tcall, [LI] = &&op_li, [LC] = &&op_lc, [SI] = &&op_si,
+        [SC] = &&op_sc, [PUSH] = &&op_push, [OR] = &&op_or, [XOR] = &&op_xor,
+        [AND] = &&op_and, [EQ] = &&op_eq, [NE] = &&op_ne, [LT] = &&op_lt,
+        [GT] = &&op_gt, [LE] = &&op_le, [GE] = &&op_ge, [SHL] = &&op_shl,
+        [SHR] = &&op_shr, [ADD] = &&op_add, [SUB] = &&op_sub, [MUL] = &&op_mul,
+        [DIV] = &&op_div, [MOD] = &&op_mod, [OPEN] = &&op_open, [READ] = &&op_read,
+        [CLOS] = &&op_clos, [PRTF] = &&op_prtf, [MALC] = &&op_malc, [FREE] = &&op_free,
+        [MSET] = &&op_mset, [MCMP] = &&op_mcmp, [ARST] = &&op_arst, [EXIT] = &&op_exit, [LLIP] = &&op_llip, [LLI] = &&op_lli,
+        [LEAP] = &&op_leap, [LIP] = &&op_lip, [IMMP] = &&op_immp, [ADDI] = &&op_addi,
+        [SUBI] = &&op_subi, [MULI] = &&op_muli, [LTI] = &&op_lti
+    };
+    int64_t ax, *tmp, i;
 
-    // point to stack base/bottom
-    bp = sp = (int64_t*)((char*)stack + poolsize);
+    if (!pc) {
+        threaded_handler = handler;
+        return 0;
+    }
     ax = 0;
 
-    src = "char else enum if int return sizeof while "
-        "open read close printf malloc memset memcmp exit void main";
-    // add keywords to symbol table
-    i = Char;
-    while (i <= While) {
-        next();
-        current_id[Token] = i++;
+#define DISPATCH() goto *(void*)*pc++
+    DISPATCH();
+
+op_imm:  ax = *pc++; DISPATCH();
+op_lc:   ax = *(char*)ax; DISPATCH();
+op_li:   ax = *(int64_t*)ax; DISPATCH();
+op_sc:   *(char*)*sp++ = ax; DISPATCH();
+op_si:   *(int64_t*)*sp++ = ax; DISPATCH();
+op_push: *--sp = ax; DISPATCH();
+op_jmp:  pc = (int64_t*)*pc; DISPATCH();
+op_jz:   pc = ax ? (pc + 1) : (int64_t*)*pc; DISPATCH();
+op_jnz:  pc = ax ? (int64_t*)*pc : (pc + 1); DISPATCH();
+op_call: *--sp = (int64_t)(pc + 1); pc = (int64_t*)*pc; DISPATCH();
+op_ent:  *--sp = (int64_t)bp; bp = sp; sp = sp - *pc++; DISPATCH();
+op_adj:  sp = sp + *pc++; DISPATCH();
+op_lev:  sp = bp; bp = (int64_t*)*sp++; pc = (int64_t*)*sp++; DISPATCH();
+op_tcall:
+    i = pc[1];
+    while (i-- > 0) {
+        bp[2 + i] = sp[i];
+    }
+    sp = bp + 1;
+    bp = (int64_t*)*bp;
+    pc = (int64_t*)*pc;
+    DISPATCH();
+op_lea:  ax = (int64_t)(bp + *pc++); DISPATCH();
+op_or:   ax = *sp++ | ax; DISPATCH();
+op_xor:  ax = *sp++ ^ ax; DISPATCH();
+op_and:  ax = *sp++ & ax; DISPATCH();
+op_eq:   ax = *sp++ == ax; DISPATCH();
+op_ne:   ax = *sp++ != ax; DISPATCH();
+op_lt:   ax = *sp++ < ax; DISPATCH();
+op_le:   ax = *sp++ <= ax; DISPATCH();
+op_gt:   ax = *sp++ > ax; DISPATCH();
+op_ge:   ax = *sp++ >= ax; DISPATCH();
+op_shl:  ax = *sp++ << ax; DISPATCH();
+op_shr:  ax = *sp++ >> ax; DISPATCH();
+op_add:  ax = *sp++ + ax; DISPATCH();
+op_sub:  ax = *sp++ - ax; DISPATCH();
+op_mul:  ax = *sp++ * ax; DISPATCH();
+op_div:  ax = *sp++ / ax; DISPATCH();
+op_mod:  ax = *sp++ % ax; DISPATCH();
+op_open: ax = open((char*)sp[1], sp[0]); DISPATCH();
+op_clos: ax = close(*sp); DISPATCH();
+op_read: ax = read(sp[2], (char*)sp[1], *sp); DISPATCH();
+op_prtf:
+    tmp = sp + pc[1];
+    ax = fprintf(out, (char*)tmp[-1], tmp[-2], tmp[-3], tmp[-4], tmp[-5], tmp[-6]);
+    DISPATCH();
+op_llip: *--sp = ax = *(bp + *pc++); DISPATCH();
+op_lli:  ax = *(bp + *pc++); DISPATCH();
+op_leap: *--sp = ax = (int64_t)(bp + *pc++); DISPATCH();
+op_lip:  *--sp = ax = *(int64_t*)ax; DISPATCH();
+op_immp: *--sp = ax = *pc++; DISPATCH();
+op_addi: ax = ax + *pc++; DISPATCH();
+op_subi: ax = ax - *pc++; DISPATCH();
+op_muli: ax = ax * *pc++; DISPATCH();
+op_lti:  ax = ax < *pc++; DISPATCH();
+op_malc: ax = (int64_t)heap_alloc(*sp); DISPATCH();
+op_free: heap_free((void*)*sp); DISPATCH();
+op_mset: ax = (int64_t)memset((char*)sp[2], sp[1], *sp); DISPATCH();
+op_mcmp: ax = memcmp((char*)sp[2], (char*)sp[1], *sp); DISPATCH();
+op_arst: heap_reset(0); DISPATCH();
+op_exit:
+    return *sp;
+#undef DISPATCH
+}
+
+// translate the text segment for eval_threaded(), with the data addresses in
+// immediates rebased onto `view`, a copy of the data segment. Cell offsets are
+// kept so that operands can be rebased by simple pointer arithmetic.
+int64_t* threaded_code(char* view)
+{
+    int64_t *code, *p, *c, op;
+
+    if (!threaded_handler) {
+        eval_threaded(0, 0, 0, 0);
+    }
+    if (!(code = malloc((text - old_text + 1) * sizeof(int64_t)))) {
+        printf("could not malloc(%ld) for threaded code\n", (text - old_text + 1) * sizeof(int64_t));
+        return 0;
+    }
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        c = code + (p - old_text);
+        if (op < 0 || op > LTI) {
+            printf("unknown instruction: %ld\n", op);
+            free(code);
+            return 0;
+        }
+        c[0] = (int64_t)threaded_handler[op];
+        if (op_operands(op)) {
+            c[1] = p[1];
+            if (op_is_jump(op)) {
+                c[1] = (int64_t)(code + ((int64_t*)p[1] - old_text));
+            } else if (op_is_immediate(op) && (char*)p[1] >= old_data && (char*)p[1] < data) {
+                c[1] = (int64_t)(view + ((char*)p[1] - old_data));
+            }
+        }
+        if (op_operands(op) > 1) {
+            c[2] = p[2];
+        }
+        p = p + 1 + op_operands(op);
+    }
+    return code;
+}
+#endif
+
+// register machine backend
+//
+// The stack code is translated into code for a machine with an accumulator
+// (ax) plus virtual registers, which are the cells of the current frame:
+// arguments and locals at their usual bp offsets, and one temporary per
+// expression stack depth right below the locals, exactly where PUSH would
+// have stored the value. Loads of locals and immediates are not executed but
+// tracked by the translator and folded into the operands of the instruction
+// that consumes them, so `a = b + c` becomes `RADD b, c; RST a`.
+//
+// A register operand is `n * 2` for the frame cell bp[n] and `k * 2 + 1` for
+// the constant reg_const[k].
+enum {
+    RLD,  // ax = R(a)
+    RMOV,  // bp[n] = R(a)
+    RST,  // bp[n] = ax
+    RLEA,  // bp[n] = bp + m
+    RLEAA,  // ax = bp + n
+    RLI,  // ax = *(int*)R(a)
+    RLIA,  // ax = *(int*)ax
+    RLCA,  // ax = *(char*)ax
+    RSI,  // *(int*)R(a) = ax
+    RSC,  // *(char*)R(a) = ax
+    RJMP,  // jump to
+    RJZ,  // jump if ax is zero
+    RJNZ,  // jump if ax is not zero
+    RCALL,  // sp = bp + n, call
+    RTCALL,  // sp = bp + n, tail call with k arguments
+    RENT,  // enter (make new call frame)
+    RLEV,  // restore old call frame
+    RSYS,  // sp = bp + n, run library instruction `op` with `argc` arguments
+    // ax = R(a) OP R(b), in the order of OR..MOD
+    ROR, RXOR, RAND, REQ, RNE, RLT, RGT, RLE, RGE, RSHL, RSHR, RADD, RSUB, RMUL, RDIV, RMOD,
+    // ax = R(a) OP ax, in the order of OR..MOD
+    RORA, RXORA, RANDA, REQA, RNEA, RLTA, RGTA, RLEA_, RGEA, RSHLA, RSHRA, RADDA, RSUBA, RMULA, RDIVA, RMODA
+};
+
+// where the translator keeps a value of the stack machine
+enum {
+    InAx,  // in ax
+    InTmp,  // in the temporary register of its stack depth
+    InReg,  // equal to register operand `v`, not loaded yet
+    InAddr  // equal to bp + v, not computed yet
+};
+
+int64_t* reg_code;  // register code, filled like `text`
+int64_t* reg_const;  // constant registers
+int reg_nconst;
+int reg_locals;  // local variables of the function being translated
+int reg_depth;  // expression stack depth of the stack machine
+int reg_size;  // entries of reg_kind and reg_val
+int *reg_kind, acc_kind;  // translator stack and ax, see InAx...
+int64_t *reg_val, acc_val;
+
+// make room in the translator stack for the value at depth d
+void reg_reserve(int d)
+{
+    if (d < reg_size) {
+        return;
+    }
+    reg_size = d * 2 + 256;
+    reg_kind = realloc(reg_kind, reg_size * sizeof(int));
+    reg_val = realloc(reg_val, reg_size * sizeof(int64_t));
+    if (!reg_kind || !reg_val) {
+        printf("could not malloc(%ld) for the register translator\n", reg_size * sizeof(int64_t));
+        exit(-1);
+    }
+}
+
+// frame cell of the temporary for stack depth d
+int64_t reg_tmp(int d)
+{
+    return -(reg_locals + 1 + d);
+}
+
+int64_t reg_constant(int64_t k)
+{
+    reg_const[reg_nconst] = k;
+    return reg_nconst++ * 2 + 1;
+}
+
+// make the value at stack depth d live in its temporary
+void reg_spill(int d)
+{
+    if (reg_kind[d] == InReg) {
+        *++reg_code = RMOV;
+        *++reg_code = reg_tmp(d);
+        *++reg_code = reg_val[d];
+    } else if (reg_kind[d] == InAddr) {
+        *++reg_code = RLEA;
+        *++reg_code = reg_tmp(d);
+        *++reg_code = reg_val[d];
+    }
+    reg_kind[d] = InTmp;
+}
+
+// make ax hold its value
+void reg_load_ax()
+{
+    if (acc_kind == InReg) {
+        *++reg_code = RLD;
+        *++reg_code = acc_val;
+    } else if (acc_kind == InAddr) {
+        *++reg_code = RLEAA;
+        *++reg_code = acc_val;
+    }
+    acc_kind = InAx;
+}
+
+// bring the translator to the state shared by all paths: every stack value
+// in its temporary and ax loaded
+void reg_flush()
+{
+    int d;
+    d = 0;
+    while (d < reg_depth) {
+        reg_spill(d++);
+    }
+    reg_load_ax();
+}
+
+// spill values that were not loaded from frame cells yet, before the cell
+// `slot` (or any cell, for slot 0 which is never a variable) is written
+void reg_invalidate(int64_t slot)
+{
+    int d;
+    d = 0;
+    while (d < reg_depth) {
+        if (reg_kind[d] == InReg && !(reg_val[d] & 1) && (!slot || reg_val[d] == slot * 2)) {
+            reg_spill(d);
+        }
+        d++;
+    }
+    if (acc_kind == InReg && !(acc_val & 1) && (!slot || acc_val == slot * 2)) {
+        reg_load_ax();
+    }
+}
+
+// the stack value at depth d as a register operand
+int64_t reg_operand(int d)
+{
+    if (reg_kind[d] == InAddr) {
+        reg_spill(d);
+    }
+    return reg_kind[d] == InReg ? reg_val[d] : reg_tmp(d) * 2;
+}
+
+// translate the text segment into `reg_code`, `stub` is the startup stub
+// which runs on the frame of main()'s two arguments. Returns the map from
+// text offsets to register code offsets, the caller frees it.
+//
+// reg_code holds text_size bytes. One stack instruction translates into at
+// most 4 cells, plus 3 for each value a flush spills, which is checked before
+// every instruction. reg_const needs no check: each constant comes from an
+// IMM, which takes 2 cells of text.
+int64_t* reg_translate(int64_t* stub)
+{
+    char* leader;
+    int64_t *map, *patch, *p, *base, *end, op, a;
+    int npatch;
+
+    leader = text_leaders();
+    map = calloc(text - old_text + 2, sizeof(int64_t));
+    patch = malloc((text - old_text + 1) * sizeof(int64_t));
+    npatch = 0;
+    base = reg_code;
+    end = base + text_size / sizeof(int64_t);
+    reg_depth = 0;
+    reg_locals = 0;
+    acc_kind = InAx;
+    reg_reserve(2);
+
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        if (reg_code + 3 * reg_depth + 8 > end) {
+            printf("register backend: the translated code does not fit in %ld bytes\n", text_size);
+            exit(-1);
+        }
+        if (p == stub) {
+            reg_locals = 0;
+            reg_depth = 2;
+            reg_kind[0] = reg_kind[1] = InTmp;
+        }
+        if (leader[p - old_text]) {
+            reg_flush();
+        }
+        map[p - old_text] = reg_code + 1 - base;
+
+        if (op == IMM) {
+            acc_kind = InReg;
+            acc_val = reg_constant(p[1]);
+        } else if (op == LEA) {
+            // a temporary addressed through bp (the arguments of an inlined
+            // call) has to be in memory
+            a = -p[1] - reg_locals - 1;
+            if (a >= 0 && a < reg_depth) {
+                reg_spill(a);
+            }
+            acc_kind = InAddr;
+            acc_val = p[1];
+        } else if (op == LI) {
+            if (acc_kind == InAddr) {
+                acc_kind = InReg;
+                acc_val = acc_val * 2;
+            } else if (acc_kind == InReg) {
+                *++reg_code = RLI;
+                *++reg_code = acc_val;
+                acc_kind = InAx;
+            } else {
+                *++reg_code = RLIA;
+            }
+        } else if (op == LC) {
+            reg_load_ax();
+            *++reg_code = RLCA;
+        } else if (op == PUSH) {
+            reg_reserve(reg_depth);
+            if (acc_kind == InAx) {
+                *++reg_code = RST;
+                *++reg_code = reg_tmp(reg_depth);
+                reg_kind[reg_depth] = InTmp;
+            } else {
+                reg_kind[reg_depth] = acc_kind;
+                reg_val[reg_depth] = acc_val;
+            }
+            reg_depth++;
+        } else if (op >= OR && op <= MOD) {
+            a = reg_operand(--reg_depth);
+            if (acc_kind == InReg) {
+                *++reg_code = ROR + (op - OR);
+                *++reg_code = a;
+                *++reg_code = acc_val;
+            } else {
+                reg_load_ax();
+                *++reg_code = RORA + (op - OR);
+                *++reg_code = a;
+            }
+            acc_kind = InAx;
+        } else if (op == SI || op == SC) {
+            reg_depth--;
+            if (op == SI && reg_kind[reg_depth] == InAddr) {
+                // store to a local variable
+                a = reg_val[reg_depth];
+                reg_invalidate(a);
+                if (acc_kind == InReg) {
+                    *++reg_code = RMOV;
+                    *++reg_code = a;
+                    *++reg_code = acc_val;
+                } else {
+                    reg_load_ax();
+                    *++reg_code = RST;
+                    *++reg_code = a;
+                }
+            } else {
+                a = reg_operand(reg_depth);
+                reg_invalidate(0);
+                reg_load_ax();
+                *++reg_code = (op == SI) ? RSI : RSC;
+                *++reg_code = a;
+            }
+        } else if (op == JMP || op == JZ || op == JNZ) {
+            reg_flush();
+            *++reg_code = (op == JMP) ? RJMP : (op == JZ) ? RJZ : RJNZ;
+            *++reg_code = (int64_t*)p[1] - old_text;
+            patch[npatch++] = reg_code - base;
+        } else if (op == CALL) {
+            reg_flush();
+            *++reg_code = RCALL;
+            *++reg_code = reg_tmp(reg_depth - 1);
+            *++reg_code = (int64_t*)p[1] - old_text;
+            patch[npatch++] = reg_code - base;
+        } else if (op == TCALL) {
+            reg_flush();
+            *++reg_code = RTCALL;
+            *++reg_code = reg_tmp(reg_depth - 1);
+            *++reg_code = p[2];
+            *++reg_code = (int64_t*)p[1] - old_text;
+            patch[npatch++] = reg_code - base;
+        } else if (op == ADJ && p[1] < 0) {
+            // cells reserved for an inlined call, whose body addresses the
+            // arguments below them through bp
+            reg_flush();
+            a = -p[1];
+            reg_reserve(reg_depth + a);
+            while (a-- > 0) {
+                reg_kind[reg_depth++] = InTmp;
+            }
+        } else if (op == ADJ) {
+            reg_depth = reg_depth - p[1];
+        } else if (op == ENT) {
+            *++reg_code = RENT;
+            *++reg_code = p[1];
+            reg_locals = p[1];
+            reg_depth = 0;
+            acc_kind = InAx;
+        } else if (op == LEV) {
+            reg_load_ax();
+            *++reg_code = RLEV;
+        } else if (op >= OPEN && op <= EXIT) {
+            reg_flush();
+            *++reg_code = RSYS;
+            *++reg_code = reg_tmp(reg_depth - 1);
+            *++reg_code = op;
+            *++reg_code = (p + 1 <= text && p[1] == ADJ) ? p[2] : 0;
+        } else {
+            printf("register backend: unsupported instruction %ld\n", op);
+            exit(-1);
+        }
+        p = p + 1 + op_operands(op);
+    }
+    map[p - old_text] = reg_code + 1 - base;
+
+    while (npatch-- > 0) {
+        base[patch[npatch]] = (int64_t)(base + map[base[patch[npatch]]]);
+    }
+    free(patch);
+    free(leader);
+    return map;
+}
+
+// library instructions for the backends that do not inline them, the
+// arguments are on the stack at `sp` as the stack machine leaves them
+int64_t library_call(int64_t op, int64_t* sp, int64_t argc)
+{
+    int64_t* tmp;
+    if (op == OPEN) {
+        return open((char*)sp[1], sp[0]);
+    } else if (op == CLOS) {
+        return close(*sp);
+    } else if (op == READ) {
+        return read(sp[2], (char*)sp[1], *sp);
+    } else if (op == PRTF) {
+        tmp = sp + argc;
+        return printf((char*)tmp[-1], tmp[-2], tmp[-3], tmp[-4], tmp[-5], tmp[-6]);
+    } else if (op == MALC) {
+        return (int64_t)heap_alloc(*sp);
+    } else if (op == FREE) {
+        heap_free((void*)*sp);
+        return 0;
+    } else if (op == MSET) {
+        return (int64_t)memset((char*)sp[2], sp[1], *sp);
+    } else if (op == MCMP) {
+        return memcmp((char*)sp[2], (char*)sp[1], *sp);
+    } else if (op == ARST) {
+        heap_reset(0);
+        return 0;
+    }
+    printf("unknown instruction: %ld\n", op);
+    exit(-1);
+}
+
+#define R(x) (((x) & 1) ? reg_const[(x) >> 1] : bp[(x) >> 1])
+
+int eval_register(int64_t* pc, int64_t* sp, int64_t* bp)
+{
+    int64_t ax, op;
+    ax = 0;
+    while (1) {
+        op = *pc++;
+        switch (op) {
+        case RLD: ax = R(pc[0]); pc++; break;
+        case RMOV: bp[pc[0]] = R(pc[1]); pc = pc + 2; break;
+        case RST: bp[*pc++] = ax; break;
+        case RLEA: bp[pc[0]] = (int64_t)(bp + pc[1]); pc = pc + 2; break;
+        case RLEAA: ax = (int64_t)(bp + *pc++); break;
+        case RLI: ax = *(int64_t*)R(pc[0]); pc++; break;
+        case RLIA: ax = *(int64_t*)ax; break;
+        case RLCA: ax = *(char*)ax; break;
+        case RSI: *(int64_t*)R(pc[0]) = ax; pc++; break;
+        case RSC: *(char*)R(pc[0]) = ax; pc++; break;
+        case RJMP: pc = (int64_t*)*pc; break;
+        case RJZ: pc = ax ? (pc + 1) : (int64_t*)*pc; break;
+        case RJNZ: pc = ax ? (int64_t*)*pc : (pc + 1); break;
+        case RCALL: {
+            sp = bp + pc[0];
+            *--sp = (int64_t)(pc + 2);
+            pc = (int64_t*)pc[1];
+            break;
+        }
+        case RTCALL: {
+            sp = bp + pc[0];
+            op = pc[1];
+            while (op-- > 0) {
+                bp[2 + op] = sp[op];
+            }
+            sp = bp + 1;
+            bp = (int64_t*)*bp;
+            pc = (int64_t*)pc[2];
+            break;
+        }
+        case RENT: {
+            *--sp = (int64_t)bp;
+            bp = sp;
+            sp = sp - *pc++;
+            break;
+        }
+        case RLEV: {
+            sp = bp;
+            bp = (int64_t*)*sp++;
+            pc = (int64_t*)*sp++;
+            break;
+        }
+        case RSYS: {
+            sp = bp + pc[0];
+            if (pc[1] == EXIT) {
+                printf("exit(%ld)", *sp);
+                return *sp;
+            }
+            ax = library_call(pc[1], sp, pc[2]);
+            pc = pc + 3;
+            break;
+        }
+
+        case ROR: ax = R(pc[0]) | R(pc[1]); pc = pc + 2; break;
+        case RXOR: ax = R(pc[0]) ^ R(pc[1]); pc = pc + 2; break;
+        case RAND: ax = R(pc[0]) & R(pc[1]); pc = pc + 2; break;
+        case REQ: ax = R(pc[0]) == R(pc[1]); pc = pc + 2; break;
+        case RNE: ax = R(pc[0]) != R(pc[1]); pc = pc + 2; break;
+        case RLT: ax = R(pc[0]) < R(pc[1]); pc = pc + 2; break;
+        case RGT: ax = R(pc[0]) > R(pc[1]); pc = pc + 2; break;
+        case RLE: ax = R(pc[0]) <= R(pc[1]); pc = pc + 2; break;
+        case RGE: ax = R(pc[0]) >= R(pc[1]); pc = pc + 2; break;
+        case RSHL: ax = R(pc[0]) << R(pc[1]); pc = pc + 2; break;
+        case RSHR: ax = R(pc[0]) >> R(pc[1]); pc = pc + 2; break;
+        case RADD: ax = R(pc[0]) + R(pc[1]); pc = pc + 2; break;
+        case RSUB: ax = R(pc[0]) - R(pc[1]); pc = pc + 2; break;
+        case RMUL: ax = R(pc[0]) * R(pc[1]); pc = pc + 2; break;
+        case RDIV: ax = R(pc[0]) / R(pc[1]); pc = pc + 2; break;
+        case RMOD: ax = R(pc[0]) % R(pc[1]); pc = pc + 2; break;
+
+        case RORA: ax = R(pc[0]) | ax; pc++; break;
+        case RXORA: ax = R(pc[0]) ^ ax; pc++; break;
+        case RANDA: ax = R(pc[0]) & ax; pc++; break;
+        case REQA: ax = R(pc[0]) == ax; pc++; break;
+        case RNEA: ax = R(pc[0]) != ax; pc++; break;
+        case RLTA: ax = R(pc[0]) < ax; pc++; break;
+        case RGTA: ax = R(pc[0]) > ax; pc++; break;
+        case RLEA_: ax = R(pc[0]) <= ax; pc++; break;
+        case RGEA: ax = R(pc[0]) >= ax; pc++; break;
+        case RSHLA: ax = R(pc[0]) << ax; pc++; break;
+        case RSHRA: ax = R(pc[0]) >> ax; pc++; break;
+        case RADDA: ax = R(pc[0]) + ax; pc++; break;
+        case RSUBA: ax = R(pc[0]) - ax; pc++; break;
+        case RMULA: ax = R(pc[0]) * ax; pc++; break;
+        case RDIVA: ax = R(pc[0]) / ax; pc++; break;
+        case RMODA: ax = R(pc[0]) % ax; pc++; break;
+        default: {
+            printf("unknown register instruction: %ld\n", op);
+            return -1;
+        }
+        }
+    }
+    return 0;
+}
+
+#undef R
+
+#if defined(__x86_64__)
+// x86-64 JIT
+//
+// Every instruction of the text segment is translated into native code
+// keeping ax in rax, the virtual sp in rbx and the virtual bp in r12. The
+// virtual stack and frame layout stay exactly those of eval(): CALL still
+// stores a return address cell, which holds the bytecode return address,
+// but control transfers with native call/ret. Library instructions call
+// library_call() with the native stack realigned, and EXIT unwinds back to
+// the entry thunk through the native stack pointer saved in r15.
+unsigned char* jit_code;  // executable buffer
+unsigned char* jit_pos;  // emit position
+
+void jit_emit(char* bytes, int n)
+{
+    memcpy(jit_pos, bytes, n);
+    jit_pos = jit_pos + n;
+}
+
+void jit_imm32(int64_t v)
+{
+    int32_t i;
+    i = v;
+    memcpy(jit_pos, &i, 4);
+    jit_pos = jit_pos + 4;
+}
+
+void jit_imm64(int64_t v)
+{
+    memcpy(jit_pos, &v, 8);
+    jit_pos = jit_pos + 8;
+}
+
+// whether the JIT can translate every instruction of the text segment
+int jit_supported()
+{
+    int64_t* p;
+    p = old_text + 1;
+    while (p <= text) {
+        if (*p < LEA || *p > EXIT) {
+            return 0;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+    return 1;
+}
+
+// translate the text segment and run it from `pc`, returns -1 without
+// running anything when the text segment cannot be translated
+int jit_run(int64_t* pc, int64_t* sp, int64_t* bp, int64_t* result)
+{
+    int64_t *p, *map, *patch, op, size, npatch;
+    unsigned char *epilogue;
+    int64_t (*entry)(int64_t*, int64_t*, unsigned char*);
+
+    if (!jit_supported()) {
+        return -1;
+    }
+    size = (text - old_text + 1) * 48 + 128;
+    jit_code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit_code == MAP_FAILED) {
+        return -1;
+    }
+    map = calloc(text - old_text + 2, sizeof(int64_t));
+    patch = malloc((text - old_text + 1) * 2 * sizeof(int64_t));
+    npatch = 0;
+    jit_pos = jit_code;
+
+    // entry thunk: save callee saved registers, load the virtual registers
+    // and jump to the entry point; EXIT comes back to the epilogue
+    jit_emit("\x53\x41\x54\x41\x55\x41\x56\x41\x57\x55", 10);  // push rbx, r12-r15, rbp
+    jit_emit("\x49\x89\xE7", 3);  // mov r15, rsp
+    jit_emit("\x48\x89\xFB", 3);  // mov rbx, rdi
+    jit_emit("\x49\x89\xF4", 3);  // mov r12, rsi
+    jit_emit("\xFF\xE2", 2);  // jmp rdx
+    epilogue = jit_pos;
+    jit_emit("\x4C\x89\xFC", 3);  // mov rsp, r15
+    jit_emit("\x5D\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 11);  // pop ..., ret
+
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        map[p - old_text] = jit_pos - jit_code;
+        if (op == IMM) {
+            jit_emit("\x48\xB8", 2);  // movabs rax, imm64
+            jit_imm64(p[1]);
+        } else if (op == LEA) {
+            jit_emit("\x49\x8D\x84\x24", 4);  // lea rax, [r12 + disp32]
+            jit_imm32(p[1] * 8);
+        } else if (op == LI) {
+            jit_emit("\x48\x8B\x00", 3);  // mov rax, [rax]
+        } else if (op == LC) {
+            jit_emit("\x48\x0F\xBE\x00", 4);  // movsx rax, byte [rax]
+        } else if (op == SI || op == SC) {
+            jit_emit("\x48\x8B\x0B", 3);  // mov rcx, [rbx]
+            jit_emit("\x48\x83\xC3\x08", 4);  // add rbx, 8
+            if (op == SI) {
+                jit_emit("\x48\x89\x01", 3);  // mov [rcx], rax
+            } else {
+                jit_emit("\x88\x01", 2);  // mov [rcx], al
+            }
+        } else if (op == PUSH) {
+            jit_emit("\x48\x83\xEB\x08", 4);  // sub rbx, 8
+            jit_emit("\x48\x89\x03", 3);  // mov [rbx], rax
+        } else if (op == JMP || op == JZ || op == JNZ || op == CALL) {
+            if (op == JMP) {
+                jit_emit("\xE9", 1);  // jmp rel32
+            } else if (op == JZ) {
+                jit_emit("\x48\x85\xC0\x0F\x84", 5);  // test rax, rax; jz rel32
+            } else if (op == JNZ) {
+                jit_emit("\x48\x85\xC0\x0F\x85", 5);  // test rax, rax; jnz rel32
+            } else {
+                jit_emit("\x48\x83\xEB\x08", 4);  // sub rbx, 8
+                jit_emit("\x48\xB9", 2);  // movabs rcx, return address
+                jit_imm64((int64_t)(p + 2));
+                jit_emit("\x48\x89\x0B", 3);  // mov [rbx], rcx
+                jit_emit("\xE8", 1);  // call rel32
+            }
+            patch[npatch++] = jit_pos - jit_code;
+            patch[npatch++] = (int64_t*)p[1] - old_text;
+            jit_imm32(0);
+        } else if (op == TCALL) {
+            // move the arguments over those of the frame, unwind it and
+            // jump: the callee returns with our native return address
+            jit_emit("\x48\x89\xDE", 3);  // mov rsi, rbx
+            jit_emit("\x49\x8D\x7C\x24\x10", 5);  // lea rdi, [r12 + 16]
+            jit_emit("\xB9", 1);  // mov ecx, args
+            jit_imm32(p[2]);
+            jit_emit("\xF3\x48\xA5", 3);  // rep movsq
+            jit_emit("\x49\x8D\x5C\x24\x08", 5);  // lea rbx, [r12 + 8]
+            jit_emit("\x4D\x8B\x24\x24", 4);  // mov r12, [r12]
+            jit_emit("\xE9", 1);  // jmp rel32
+            patch[npatch++] = jit_pos - jit_code;
+            patch[npatch++] = (int64_t*)p[1] - old_text;
+            jit_imm32(0);
+        } else if (op == ENT) {
+            jit_emit("\x48\x83\xEB\x08", 4);  // sub rbx, 8
+            jit_emit("\x4C\x89\x23", 3);  // mov [rbx], r12
+            jit_emit("\x49\x89\xDC", 3);  // mov r12, rbx
+            jit_emit("\x48\x81\xEB", 3);  // sub rbx, imm32
+            jit_imm32(p[1] * 8);
+        } else if (op == ADJ) {
+            jit_emit("\x48\x81\xC3", 3);  // add rbx, imm32
+            jit_imm32(p[1] * 8);
+        } else if (op == LEV) {
+            jit_emit("\x4C\x89\xE3", 3);  // mov rbx, r12
+            jit_emit("\x4C\x8B\x23", 3);  // mov r12, [rbx]
+            jit_emit("\x48\x83\xC3\x10", 4);  // add rbx, 16
+            jit_emit("\xC3", 1);  // ret
+        } else if (op >= OR && op <= MOD) {
+            jit_emit("\x48\x89\xC1", 3);  // mov rcx, rax
+            jit_emit("\x48\x8B\x03", 3);  // mov rax, [rbx]
+            jit_emit("\x48\x83\xC3\x08", 4);  // add rbx, 8
+            if (op == OR) {
+                jit_emit("\x48\x09\xC8", 3);  // or rax, rcx
+            } else if (op == XOR) {
+                jit_emit("\x48\x31\xC8", 3);  // xor rax, rcx
+            } else if (op == AND) {
+                jit_emit("\x48\x21\xC8", 3);  // and rax, rcx
+            } else if (op == ADD) {
+                jit_emit("\x48\x01\xC8", 3);  // add rax, rcx
+            } else if (op == SUB) {
+                jit_emit("\x48\x29\xC8", 3);  // sub rax, rcx
+            } else if (op == MUL) {
+                jit_emit("\x48\x0F\xAF\xC1", 4);  // imul rax, rcx
+            } else if (op == DIV) {
+                jit_emit("\x48\x99\x48\xF7\xF9", 5);  // cqo; idiv rcx
+            } else if (op == MOD) {
+                jit_emit("\x48\x99\x48\xF7\xF9", 5);  // cqo; idiv rcx
+                jit_emit("\x48\x89\xD0", 3);  // mov rax, rdx
+            } else if (op == SHL) {
+                jit_emit("\x48\xD3\xE0", 3);  // shl rax, cl
+            } else if (op == SHR) {
+                jit_emit("\x48\xD3\xF8", 3);  // sar rax, cl
+            } else {
+                jit_emit("\x48\x39\xC8\x0F", 4);  // cmp rax, rcx; setcc al
+                jit_emit(op == EQ ? "\x94" : op == NE ? "\x95" : op == LT ? "\x9C" :
+                         op == GT ? "\x9F" : op == LE ? "\x9E" : "\x9D", 1);
+                jit_emit("\xC0\x0F\xB6\xC0", 4);  // movzx eax, al
+            }
+        } else if (op == EXIT) {
+            jit_emit("\x48\x8B\x03", 3);  // mov rax, [rbx]
+            jit_emit("\xE9", 1);  // jmp epilogue
+            jit_imm32(epilogue - (jit_pos + 4));
+        } else {
+            // library instruction: library_call(op, sp, argc)
+            jit_emit("\xBF", 1);  // mov edi, op
+            jit_imm32(op);
+            jit_emit("\x48\x89\xDE", 3);  // mov rsi, rbx
+            jit_emit("\xBA", 1);  // mov edx, argc
+            jit_imm32((p + 1 <= text && p[1] == ADJ) ? p[2] : 0);
+            jit_emit("\x49\x89\xE5", 3);  // mov r13, rsp
+            jit_emit("\x48\x83\xE4\xF0", 4);  // and rsp, -16
+            jit_emit("\x48\xB9", 2);  // movabs rcx, library_call
+            jit_imm64((int64_t)library_call);
+            jit_emit("\xFF\xD1", 2);  // call rcx
+            jit_emit("\x4C\x89\xEC", 3);  // mov rsp, r13
+        }
+        p = p + 1 + op_operands(op);
+    }
+
+    while (npatch > 0) {
+        npatch = npatch - 2;
+        jit_pos = jit_code + patch[npatch];
+        jit_imm32(map[patch[npatch + 1]] - (patch[npatch] + 4));
+    }
+    free(patch);
+
+    if (mprotect(jit_code, size, PROT_READ | PROT_EXEC) < 0) {
+        free(map);
+        munmap(jit_code, size);
+        return -1;
+    }
+    entry = (int64_t (*)(int64_t*, int64_t*, unsigned char*))jit_code;
+    *result = entry(sp, bp, jit_code + map[pc - old_text]);
+    free(map);
+    munmap(jit_code, size);
+    return 0;
+}
+#endif
+
+// compact bytecode
+//
+// Instructions are re-encoded as a one byte opcode followed by their
+// operands: jump and call targets as 4 byte offsets relative to the end of
+// the operand, everything else as a zigzag LEB128 varint, so `IMM 1` takes
+// 2 bytes instead of 16. Return addresses on the stack are byte addresses.
+unsigned char* compact_code;
+
+int compact_put(unsigned char* p, int64_t v)
+{
+    uint64_t u;
+    int n;
+    u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    n = 0;
+    while (u >= 0x80) {
+        if (p) {
+            p[n] = u | 0x80;
+        }
+        u = u >> 7;
+        n++;
+    }
+    if (p) {
+        p[n] = u;
+    }
+    return n + 1;
+}
+
+int64_t compact_get(unsigned char** pp)
+{
+    unsigned char* p;
+    uint64_t u;
+    int shift;
+    p = *pp;
+    u = *p & 0x7f;
+    shift = 7;
+    while (*p++ & 0x80) {
+        u = u | (uint64_t)(*p & 0x7f) << shift;
+        shift = shift + 7;
+    }
+    *pp = p;
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+int32_t compact_get32(unsigned char* p)
+{
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// encode the text segment into `compact_code`, returns the map from text
+// offsets to byte offsets, the caller frees it
+int64_t* compact_encode()
+{
+    int64_t *map, *p, op, n;
+    unsigned char* q;
+    int k;
+    int32_t rel;
+
+    map = calloc(text - old_text + 2, sizeof(int64_t));
+    // lay out the instructions
+    n = 0;
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        map[p - old_text] = n;
+        n++;
+        k = 1;
+        while (k <= op_operands(op)) {
+            n = n + ((op_is_jump(op) && k == 1) ? 4 : compact_put(0, p[k]));
+            k++;
+        }
+        p = p + 1 + op_operands(op);
+    }
+    map[p - old_text] = n;
+    compact_code = malloc(n + 1);
+
+    // emit them
+    q = compact_code;
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        *q++ = op;
+        k = 1;
+        while (k <= op_operands(op)) {
+            if (op_is_jump(op) && k == 1) {
+                rel = map[(int64_t*)p[k] - old_text] - (q + 4 - compact_code);
+                memcpy(q, &rel, 4);
+                q = q + 4;
+            } else {
+                q = q + compact_put(q, p[k]);
+            }
+            k++;
+        }
+        p = p + 1 + op_operands(op);
+    }
+    return map;
+}
+
+int eval_compact(unsigned char* pc, int64_t* sp, int64_t* bp)
+{
+    int64_t ax, op, *tmp;
+    unsigned char* q;
+    ax = 0;
+    while (1) {
+        op = *pc++;
+        switch (op) {
+        case IMM: ax = compact_get(&pc); break;
+        case LC: ax = *(char*)ax; break;
+        case LI: ax = *(int64_t*)ax; break;
+        case SC: *(char*)*sp++ = ax; break;
+        case SI: *(int64_t*)*sp++ = ax; break;
+        case PUSH: *--sp = ax; break;
+        case JMP: pc = pc + 4 + compact_get32(pc); break;
+        case JZ: pc = pc + 4 + (ax ? 0 : compact_get32(pc)); break;
+        case JNZ: pc = pc + 4 + (ax ? compact_get32(pc) : 0); break;
+        case CALL: {
+            *--sp = (int64_t)(pc + 4);
+            pc = pc + 4 + compact_get32(pc);
+            break;
+        }
+        case TCALL: {
+            q = pc + 4 + compact_get32(pc);
+            pc = pc + 4;
+            op = compact_get(&pc);
+            while (op-- > 0) {
+                bp[2 + op] = sp[op];
+            }
+            sp = bp + 1;
+            bp = (int64_t*)*bp;
+            pc = q;
+            break;
+        }
+        case ENT: {
+            *--sp = (int64_t)bp;
+            bp = sp;
+            sp = sp - compact_get(&pc);
+            break;
+        }
+        case ADJ: sp = sp + compact_get(&pc); break;
+        case LEV: {
+            sp = bp;
+            bp = (int64_t*)*sp++;
+            pc = (unsigned char*)*sp++;
+            break;
+        }
+        case LEA: ax = (int64_t)(bp + compact_get(&pc)); break;
+        case OR: ax = *sp++ | ax; break;
+        case XOR: ax = *sp++ ^ ax; break;
+        case AND: ax = *sp++ & ax; break;
+        case EQ: ax = *sp++ == ax; break;
+        case NE: ax = *sp++ != ax; break;
+        case LT: ax = *sp++ < ax; break;
+        case LE: ax = *sp++ <= ax; break;
+        case GT: ax = *sp++ > ax; break;
+        case GE: ax = *sp++ >= ax; break;
+        case SHL: ax = *sp++ << ax; break;
+        case SHR: ax = *sp++ >> ax; break;
+        case ADD: ax = *sp++ + ax; break;
+        case SUB: ax = *sp++ - ax; break;
+        case MUL: ax = *sp++ * ax; break;
+        case DIV: ax = *sp++ / ax; break;
+        case MOD: ax = *sp++ % ax; break;
+        case LLIP: *--sp = ax = *(bp + compact_get(&pc)); break;
+        case LLI: ax = *(bp + compact_get(&pc)); break;
+        case LEAP: *--sp = ax = (int64_t)(bp + compact_get(&pc)); break;
+        case LIP: *--sp = ax = *(int64_t*)ax; break;
+        case IMMP: *--sp = ax = compact_get(&pc); break;
+        case ADDI: ax = ax + compact_get(&pc); break;
+        case SUBI: ax = ax - compact_get(&pc); break;
+        case MULI: ax = ax * compact_get(&pc); break;
+        case LTI: ax = ax < compact_get(&pc); break;
+        case EXIT: {
+            printf("exit(%ld)", *sp);
+            return *sp;
+        }
+        case PRTF: {
+            // the argument count is the operand of the following ADJ
+            q = pc + 1;
+            tmp = sp + (*pc == ADJ ? compact_get(&q) : 0);
+            ax = printf((char*)tmp[-1], tmp[-2], tmp[-3], tmp[-4], tmp[-5], tmp[-6]);
+            break;
+        }
+        case OPEN: case READ: case CLOS: case MALC: case FREE: case MSET: case MCMP: case ARST: {
+            ax = library_call(op, sp, 0);
+            break;
+        }
+        default: {
+            printf("unknown instruction: %ld\n", op);
+            return -1;
+        }
+        }
+    }
+    return 0;
+}
+
+// the function whose entry point is `addr`, 0 if there is none
+int64_t* function_at(int64_t* addr)
+{
+    int64_t* id;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun && (int64_t*)id[Value] == addr) {
+            return id;
+        }
+        id = id + IdSize;
+    }
+    return 0;
+}
+
+// C operators of OR..MOD
+char* c_operator[] = {
+    "|", "^", "&", "==", "!=", "<", ">", "<=", ">=", "<<", ">>", "+", "-", "*", "/", "%"
+};
+
+// ahead-of-time translation to C
+//
+// Writes a standalone C program equivalent to the compiled text and data
+// segments. Every function becomes a C function and every jump a goto, the
+// virtual stack keeps the layout eval() gives it so that arguments and locals
+// are still addressed through bp. Calls are native C calls, the return
+// address cell of the frame is left zero. String literals and globals live in
+// a copy of the data segment and IMM operands that point into it are
+// rewritten relative to that copy. `stub` is the startup stub, which becomes
+// the C main().
+int emit_c(char* path, int64_t* stub)
+{
+    FILE* out;
+    char* leader;
+    int64_t *p, *id, op;
+    char* d;
+    int i;
+    int in_function;
+
+    if (!(out = fopen(path, "w"))) {
+        printf("could not open(%s)\n", path);
+        return -1;
+    }
+    leader = text_leaders();
+    in_function = 0;
+
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n");
+    fprintf(out, "#include <stdint.h>\n#include <fcntl.h>\n#include <unistd.h>\n\n");
+    fprintf(out, "static int64_t stack_[%ld];\nstatic int64_t* sp = stack_ + %ld;\n",
+            stack_size / 8, stack_size / 8);
+    fprintf(out, "static unsigned char data_[%ld] __attribute__((aligned(8))) = {",
+            data - old_data + 1);
+    d = old_data;
+    while (d < data) {
+        fprintf(out, "%s%d,", (d - old_data) % 16 ? " " : "\n    ", (unsigned char)*d);
+        d++;
+    }
+    fprintf(out, "\n};\n\n");
+
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun) {
+            fprintf(out, "static int64_t f_%.*s(void);\n", id_length(id), (char*)id[Name]);
+        }
+        id = id + IdSize;
+    }
+
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        if (p < stub && !function_containing(p)) {
+            // the JMP stub of a prototype, calls do not go through it
+            p = p + 1 + op_operands(op);
+            continue;
+        }
+        if (p == stub) {
+            fprintf(out, "}\n\nint main(int argc, char** argv)\n{\n    int64_t ax;\n");
+            fprintf(out, "    *--sp = argc;\n    *--sp = (int64_t)argv;\n");
+        } else if ((id = function_at(p))) {
+            if (in_function) {
+                fprintf(out, "}\n");
+            }
+            in_function = 1;
+            fprintf(out, "\nstatic int64_t f_%.*s(void)\n{\n    int64_t ax = 0, *bp;\n",
+                    id_length(id), (char*)id[Name]);
+        }
+        if (leader[p - old_text]) {
+            fprintf(out, "L%ld:\n", p - old_text);
+        }
+
+        fprintf(out, "    ");
+        if (op == IMM) {
+            if ((char*)p[1] >= old_data && (char*)p[1] < data) {
+                fprintf(out, "ax = (int64_t)(data_ + %ld);\n", (char*)p[1] - old_data);
+            } else {
+                fprintf(out, "ax = %ldLL;\n", p[1]);
+            }
+        } else if (op == LEA) {
+            fprintf(out, "ax = (int64_t)(bp + %ld);\n", p[1]);
+        } else if (op == LI) {
+            fprintf(out, "ax = *(int64_t*)ax;\n");
+        } else if (op == LC) {
+            fprintf(out, "ax = *(char*)ax;\n");
+        } else if (op == SI) {
+            fprintf(out, "*(int64_t*)*sp++ = ax;\n");
+        } else if (op == SC) {
+            fprintf(out, "*(char*)*sp++ = ax;\n");
+        } else if (op == PUSH) {
+            fprintf(out, "*--sp = ax;\n");
+        } else if (op == JMP) {
+            fprintf(out, "goto L%ld;\n", (int64_t*)p[1] - old_text);
+        } else if (op == JZ) {
+            fprintf(out, "if (!ax) goto L%ld;\n", (int64_t*)p[1] - old_text);
+        } else if (op == JNZ) {
+            fprintf(out, "if (ax) goto L%ld;\n", (int64_t*)p[1] - old_text);
+        } else if (op == CALL) {
+            id = function_at((int64_t*)p[1]);
+            fprintf(out, "*--sp = 0; ax = f_%.*s();\n", id_length(id), (char*)id[Name]);
+        } else if (op == TCALL) {
+            id = function_at((int64_t*)p[1]);
+            fprintf(out, "memmove(bp + 2, sp, %ld * sizeof(int64_t)); sp = bp + 1; return f_%.*s();\n",
+                    p[2], id_length(id), (char*)id[Name]);
+        } else if (op == ENT) {
+            fprintf(out, "*--sp = 0; bp = sp; sp = sp - %ld;\n", p[1]);
+        } else if (op == ADJ) {
+            fprintf(out, "sp = sp + %ld;\n", p[1]);
+        } else if (op == LEV) {
+            fprintf(out, "sp = bp + 2; return ax;\n");
+        } else if (op >= OR && op <= MOD) {
+            fprintf(out, "ax = *sp++ %s ax;\n", c_operator[op - OR]);
+        } else if (op == OPEN) {
+            fprintf(out, "ax = open((char*)sp[1], sp[0]);\n");
+        } else if (op == READ) {
+            fprintf(out, "ax = read(sp[2], (char*)sp[1], *sp);\n");
+        } else if (op == CLOS) {
+            fprintf(out, "ax = close(*sp);\n");
+        } else if (op == PRTF) {
+            i = (p + 1 <= text && p[1] == ADJ) ? p[2] : 0;
+            fprintf(out, "ax = printf((char*)sp[%d], sp[%d], sp[%d], sp[%d], sp[%d], sp[%d]);\n",
+                    i - 1, i - 2, i - 3, i - 4, i - 5, i - 6);
+        } else if (op == MALC) {
+            fprintf(out, "ax = (int64_t)malloc(*sp);\n");
+        } else if (op == FREE) {
+            fprintf(out, "free((void*)*sp);\n");
+        } else if (op == ARST) {
+            // the C library has no arena, the blocks are not reclaimed
+            fprintf(out, "(void)0;\n");
+        } else if (op == MSET) {
+            fprintf(out, "ax = (int64_t)memset((char*)sp[2], sp[1], *sp);\n");
+        } else if (op == MCMP) {
+            fprintf(out, "ax = memcmp((char*)sp[2], (char*)sp[1], *sp);\n");
+        } else if (op == EXIT) {
+            fprintf(out, "printf(\"exit(%%ld)\", *sp); exit(*sp);\n");
+        } else {
+            printf("emit-c: unsupported instruction %ld\n", op);
+            fclose(out);
+            free(leader);
+            return -1;
+        }
+        p = p + 1 + op_operands(op);
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+    free(leader);
+    return 0;
+}
+
+// disassemble the text segment to stdout. Functions and jump targets get a
+// label line, jump operands are printed as labels or function names and IMM
+// operands that point into the data segment as the global variable or the
+// string literal found there. `stub` is the startup stub.
+void dump_text(int64_t* stub)
+{
+    char* leader;
+    int64_t *p, *id, op;
+    char* d;
+    int n;
+
+    leader = text_leaders();
+    p = old_text + 1;
+    while (p <= text) {
+        op = *p;
+        if (p == stub) {
+            printf("\n<startup>:\n");
+        } else if ((id = function_at(p))) {
+            printf("\n%.*s:\n", id_length(id), (char*)id[Name]);
+        } else if (leader[p - old_text]) {
+            printf("L%ld:\n", p - old_text);
+        }
+        printf("    %6ld  %-6s", p - old_text, op_name[op]);
+        if (op_is_jump(op)) {
+            if ((id = function_at((int64_t*)p[1]))) {
+                printf(" %.*s", id_length(id), (char*)id[Name]);
+            } else {
+                printf(" L%ld", (int64_t*)p[1] - old_text);
+            }
+            if (op_operands(op) > 1) {
+                printf(", %ld", p[2]);
+            }
+        } else if (op_operands(op)) {
+            printf(" %ld", p[1]);
+        }
+        if ((op == IMM || op == IMMP) && (char*)p[1] >= old_data && (char*)p[1] < data) {
+            id = symbols;
+            while (id[Token] && !(id[Class] == Glo && (char*)id[Value] == (char*)p[1])) {
+                id = id + IdSize;
+            }
+            if (id[Token]) {
+                printf("\t; &%.*s", id_length(id), (char*)id[Name]);
+            } else {
+                printf("\t; \"");
+                d = (char*)p[1];
+                n = 0;
+                while (*d && n++ < 40) {
+                    if (*d == '\n') {
+                        printf("\\n");
+                    } else if (*d == '"' || *d == '\\') {
+                        printf("\\%c", *d);
+                    } else if (*d < ' ' || *d > '~') {
+                        printf("\\x%02x", (unsigned char)*d);
+                    } else {
+                        putchar(*d);
+                    }
+                    d++;
+                }
+                printf(*d ? "\"..." : "\"");
+            }
+        } else if (text_line[p - old_text]) {
+            printf("\t; line %d", text_line[p - old_text]);
+        }
+        printf("\n");
+        p = p + 1 + op_operands(op);
+    }
+    free(leader);
+}
+
+// VM segments
+//
+// Each segment is reserved as one anonymous mapping with a PROT_NONE guard
+// page on either side; the kernel only backs the pages that get touched.
+// Running off the end of a segment (the text or data segment while
+// compiling, the stack while running) hits a guard page, and the SIGSEGV
+// handler reports which segment overflowed instead of corrupting memory.
+struct segment {
+    char* name;
+    char* base;  // the low guard page
+    int64_t size;  // usable bytes, between the guard pages
+} segments[64];  // the four segments, and the stacks of batch workers
+int nsegments;
+
+void segment_fault(int sig, siginfo_t* info, void* context)
+{
+    char* addr;
+    int64_t page;
+    int i;
+
+    addr = info->si_addr;
+    page = getpagesize();
+    i = 0;
+    while (i < nsegments) {
+        if ((addr >= segments[i].base && addr < segments[i].base + page) ||
+            (addr >= segments[i].base + page + segments[i].size &&
+             addr < segments[i].base + 2 * page + segments[i].size)) {
+            fflush(stdout);
+            printf("\n%s segment overflow (%ld bytes), see --%s=SIZE\n", segments[i].name,
+                   segments[i].size, segments[i].name);
+            fflush(stdout);
+            _exit(-1);
+        }
+        i++;
+    }
+    // not ours, fault again with the default action
+    signal(SIGSEGV, SIG_DFL);
+}
+
+// reserve the segment `name` of `*size` bytes, rounded up to whole pages
+char* segment_alloc(char* name, int64_t* size)
+{
+    char* base;
+    int64_t page;
+
+    page = getpagesize();
+    *size = (*size + page - 1) & -page;
+    base = mmap(0, *size + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED || mprotect(base + page, *size, PROT_READ | PROT_WRITE) < 0) {
+        printf("could not mmap(%ld) for %s segment\n", *size, name);
+        return 0;
+    }
+#ifndef CINTERP_LIBRARY
+    // the library leaves SIGSEGV to its host, an overflow just faults there
+    if (nsegments < sizeof(segments) / sizeof(segments[0])) {
+        segments[nsegments].name = name;
+        segments[nsegments].base = base;
+        segments[nsegments].size = *size;
+        nsegments++;
+    }
+
+    if (nsegments == 1) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = segment_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &action, 0);
+    }
+#endif
+    return base + page;
+}
+
+// release a segment reserved by segment_alloc()
+void segment_free(char* p, int64_t size)
+{
+    munmap(p - getpagesize(), size + 2 * getpagesize());
+}
+
+// a size option value: a number of bytes with an optional K, M or G suffix
+int64_t parse_size(char* s)
+{
+    char* end;
+    int64_t n;
+
+    n = strtoll(s, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        n = n << 10;
+    } else if (*end == 'M' || *end == 'm') {
+        n = n << 20;
+    } else if (*end == 'G' || *end == 'g') {
+        n = n << 30;
+    }
+    return n;
+}
+
+// load the source file at `path`, or standard input for "-", and return it
+// zero terminated, 0 on failure. A regular file is mapped: an extra page of
+// zeros is reserved behind it so the terminator exists even when the size
+// is a multiple of the page size. Anything else (pipes, terminals) is read
+// into a growing buffer.
+char* load_source(char* path)
+{
+    struct stat st;
+    char *p, *map;
+    int64_t size, len, n;
+    int fd;
+
+    if (!strcmp(path, "-")) {
+        fd = 0;
+    } else if ((fd = open(path, 0)) < 0) {
+        printf("could not open(%s)\n", path);
+        return 0;
+    }
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = (st.st_size + getpagesize()) & -(int64_t)getpagesize();
+        map = mmap(0, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED) {
+            p = mmap(map, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+            if (p != MAP_FAILED) {
+                if (fd) {
+                    close(fd);
+                }
+                return p;
+            }
+            munmap(map, size);
+        }
+    }
+
+    // streaming fallback
+    size = 64 * 1024;
+    len = 0;
+    p = malloc(size);
+    while (p && (n = read(fd, p + len, size - 1 - len)) > 0) {
+        len = len + n;
+        if (len == size - 1) {
+            size = size * 2;
+            p = realloc(p, size);
+        }
+    }
+    if (fd) {
+        close(fd);
+    }
+    if (!p || n < 0) {
+        printf("could not read(%s)\n", path);
+        return 0;
+    }
+    p[len] = 0;  // add EOF character
+    return p;
+}
+
+// point every call through a `JMP` stub (a prototype's) at the stub's target
+void link_calls()
+{
+    int64_t *p, *t;
+    int hops;
+
+    p = old_text + 1;
+    while (p <= text) {
+        if (*p == CALL || *p == TCALL) {
+            t = (int64_t*)p[1];
+            hops = 0;
+            while (*t == JMP && (int64_t*)t[1] != t && hops++ < 16) {
+                t = (int64_t*)t[1];
+            }
+            p[1] = (int64_t)t;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+}
+
+// compile the source at `src` into text and data. The passes only rewrite
+// the code it adds: the library hands out the addresses of the functions
+// compiled before, which must not move.
+void compile_source(int dce, int fuse)
+{
+    int64_t* from;
+
+    from = text + 1;
+    // left over from an earlier compile, they may point into code the
+    // passes have since moved
+    const_at = call_at = 0;
+    line = 1;
+    tokenize();
+    program();
+    record_lines();
+    link_calls();
+    if (dce) {
+        optimize_jumps(from);
+    }
+    if (fuse) {
+        fuse_superinstructions(from);
+    }
+}
+
+// compile the source file at `path` into text and data, returns 0 or -1
+int compile(char* path, int dce, int fuse)
+{
+    // the source is read from standard input without a file argument
+    if (!(src = old_src = load_source(path))) {
+        return -1;
+    }
+    compile_source(dce, fuse);
+    return 0;
+}
+
+// append the startup stub, returns it or 0 without a main()
+int64_t* startup()
+{
+    int64_t* stub;
+
+    // 设置程序启动运行的函数是main函数
+    // 之后手动调用main，放入2个参数到栈中，设置返回IP跳转地址
+    if (!idmain[Value] || idmain[Class] != Fun) {
+        return 0;
+    }
+    // start up through a `CALL main; PUSH; EXIT` stub appended to the text
+    // segment: main returns to the PUSH, which hands ax (the return value of
+    // main) to EXIT. Keeping the stub in text lets every dispatch engine treat
+    // it as ordinary code.
+    stub = text + 1;
+    *++text = CALL;
+    *++text = idmain[Value];
+    *++text = PUSH;
+    *++text = EXIT;
+    return stub;
+}
+
+// the functions of the symbol table `id` declared by a prototype and
+// defined nowhere, returns -1 after reporting them
+int link_check(int64_t* id)
+{
+    int undefined;
+
+    undefined = 0;
+    while (id[Token]) {
+        if (id[Class] == Fun && !id[Extent]) {
+            printf("undefined function %.*s\n", id_length(id), (char*)id[Name]);
+            undefined = -1;
+        }
+        id = id + IdSize;
+    }
+    return undefined;
+}
+
+// compiled images
+//
+// An image holds the text segment, its line table and the data segment of
+// a compiled program or unit with every absolute address turned into an
+// offset, plus the list of the cells that held addresses, so it can be
+// mapped and run, or linked with other units, without the lexer and the
+// parser. Layout, in 8 byte words:
+//
+//     header     IMAGE_MAGIC, IMAGE_VERSION, text cells, data bytes,
+//                entry (the startup stub, 0 in a unit without main),
+//                relocations, symbols, name bytes
+//     text       cells 0..n, as old_text..text
+//     lines      an int per text cell, padded to a word
+//     data       padded to a word
+//     relocs     `cell * 2` for a text address, `cell * 2 + 1` for a data
+//                address, the cell holding an offset from old_text or
+//                old_data
+//     symbols    name offset, kind, value and extent of each global:
+//                ImgFun exports the function at text cells value..extent,
+//                ImgGlo the variable at data offset value and ImgImport
+//                is a prototype whose `JMP` stub is at text cell value
+//     names      the symbol names, each zero terminated
+//
+// Opcode numbers are part of the format, IMAGE_VERSION changes with them.
+#define IMAGE_MAGIC 0x4547414d49344300  // "\0C4IMAGE"
+#define IMAGE_VERSION 3
+enum { ImgMagic, ImgVersion, ImgText, ImgData, ImgEntry, ImgRelocs, ImgSymbols, ImgNames, ImgHeader };
+enum { ImgFun, ImgGlo, ImgImport };
+
+// write the program to the image file `path`, `stub` is the startup stub
+int save_image(char* path, int64_t* stub)
+{
+    FILE* out;
+    int64_t header[ImgHeader], *code, *relocs, *p, *id, v[4];
+    int64_t ntext, ndata, nreloc, nsym, nnames, zero;
+
+    ntext = text - old_text;
+    ndata = (data - old_data + 7) & -8;
+    code = malloc((ntext + 1) * sizeof(int64_t));
+    relocs = malloc((ntext + 1) * sizeof(int64_t));
+    memcpy(code, old_text, (ntext + 1) * sizeof(int64_t));
+    nreloc = 0;
+    p = old_text + 1;
+    while (p <= text) {
+        v[0] = p[1];
+        if (op_is_jump(*p)) {
+            code[p + 1 - old_text] = (int64_t*)v[0] - old_text;
+            relocs[nreloc++] = (p + 1 - old_text) * 2;
+        } else if (op_is_immediate(*p) && (char*)v[0] >= old_data && (char*)v[0] < data) {
+            code[p + 1 - old_text] = (char*)v[0] - old_data;
+            relocs[nreloc++] = (p + 1 - old_text) * 2 + 1;
+        }
+        p = p + 1 + op_operands(*p);
+    }
+
+    if (!(out = fopen(path, "wb"))) {
+        printf("could not open(%s)\n", path);
+        return -1;
+    }
+    nsym = 0;
+    nnames = 0;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun || id[Class] == Glo) {
+            nsym++;
+            nnames = nnames + id_length(id) + 1;
+        }
+        id = id + IdSize;
+    }
+    header[ImgMagic] = IMAGE_MAGIC;
+    header[ImgVersion] = IMAGE_VERSION;
+    header[ImgText] = ntext;
+    header[ImgData] = ndata;
+    header[ImgEntry] = stub ? stub - old_text : 0;
+    header[ImgRelocs] = nreloc;
+    header[ImgSymbols] = nsym;
+    header[ImgNames] = nnames;
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(code, sizeof(int64_t), ntext + 1, out);
+    fwrite(text_line, sizeof(int), ntext + 1, out);
+    zero = 0;
+    fwrite(&zero, 1, (ntext + 1) * sizeof(int) % 8, out);
+    fwrite(old_data, 1, ndata, out);
+    fwrite(relocs, sizeof(int64_t), nreloc, out);
+
+    nnames = 0;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun || id[Class] == Glo) {
+            v[0] = nnames;
+            v[3] = 0;
+            if (id[Class] == Glo) {
+                v[1] = ImgGlo;
+                v[2] = (char*)id[Value] - old_data;
+            } else {
+                v[1] = id[Extent] ? ImgFun : ImgImport;
+                v[2] = (int64_t*)id[Value] - old_text;
+                if (id[Extent]) {
+                    v[3] = (int64_t*)id[Extent] - old_text;
+                }
+            }
+            fwrite(v, sizeof(int64_t), 4, out);
+            nnames = nnames + id_length(id) + 1;
+        }
+        id = id + IdSize;
+    }
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun || id[Class] == Glo) {
+            fwrite((char*)id[Name], 1, id_length(id), out);
+            fwrite(&zero, 1, 1, out);
+        }
+        id = id + IdSize;
+    }
+    free(code);
+    free(relocs);
+    if (fclose(out)) {
+        printf("could not write(%s)\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// map the image file at `path` (or read it, from a pipe), returns its header
+// or 0. The mapping is private, relocation writes into it.
+int64_t* map_image(char* path)
+{
+    struct stat st;
+    int64_t *image, *header;
+    int64_t size, len, n;
+    int fd;
+
+    if (!strcmp(path, "-")) {
+        fd = 0;
+    } else if ((fd = open(path, 0)) < 0) {
+        printf("could not open(%s)\n", path);
+        return 0;
     }
-    // add library to symbol table
-    i = OPEN;
-    while (i <= EXIT) {
-        next();
-        current_id[Class] = Sys;
-        current_id[Type] = INT;
-        current_id[Value] = i++;
+    image = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        len = st.st_size;
+        image = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if (image == MAP_FAILED) {
+        size = 64 * 1024;
+        len = 0;
+        image = malloc(size);
+        while (image && (n = read(fd, (char*)image + len, size - len)) > 0) {
+            len = len + n;
+            if (len == size) {
+                size = size * 2;
+                image = realloc(image, size);
+            }
+        }
+    }
+    if (fd) {
+        close(fd);
+    }
+
+    header = image;
+    if (!image || len < sizeof(int64_t) * ImgHeader || header[ImgMagic] != IMAGE_MAGIC) {
+        printf("%s: not an image\n", path);
+        return 0;
+    }
+    if (header[ImgVersion] != IMAGE_VERSION) {
+        printf("%s: image version %ld, expected %d\n", path, header[ImgVersion], IMAGE_VERSION);
+        return 0;
+    }
+    n = ImgHeader + header[ImgText] + 1 + ((header[ImgText] + 1) * sizeof(int) + 7) / 8 +
+        header[ImgData] / 8 + header[ImgRelocs] + header[ImgSymbols] * 4;
+    if (n * sizeof(int64_t) + header[ImgNames] != len) {
+        printf("%s: truncated image\n", path);
+        return 0;
+    }
+    return header;
+}
+
+// relocate the image `header` whose text now starts at `base` (its cell 0)
+// and data at `dbase`, and enter its symbols: an exported function resolves
+// the stubs of its prototypes, a global already defined by an earlier unit
+// is shared with it, as a common symbol. Returns 0 or -1.
+int link_unit(int64_t* header, int64_t* base, char* dbase)
+{
+    int64_t *code, *relocs, *syms, *common, *p, *id, *stub;
+    int64_t i, k, ncommon;
+    char* names;
+
+    code = header + ImgHeader;
+    relocs = code + header[ImgText] + 1 + ((header[ImgText] + 1) * sizeof(int) + 7) / 8 +
+             header[ImgData] / 8;
+    syms = relocs + header[ImgRelocs];
+    names = (char*)(syms + header[ImgSymbols] * 4);
+    common = malloc((header[ImgSymbols] + 1) * 2 * sizeof(int64_t));
+
+    // globals first, the data relocations refer to the shared ones
+    ncommon = 0;
+    i = 0;
+    while (i < header[ImgSymbols]) {
+        p = syms + i * 4;
+        id = symbol_named(names + p[0]);
+        if (p[1] == ImgGlo) {
+            if (id[Class] == Glo) {
+                common[ncommon * 2] = p[2];
+                common[ncommon * 2 + 1] = id[Value];
+                ncommon++;
+            } else if (id[Class]) {
+                printf("duplicate symbol %s\n", names + p[0]);
+                return -1;
+            } else {
+                id[Class] = Glo;
+                id[Type] = INT;
+                id[Value] = (int64_t)(dbase + p[2]);
+            }
+        }
+        p[0] = (int64_t)id;
+        i++;
+    }
+
+    i = 0;
+    while (i < header[ImgRelocs]) {
+        p = base + (relocs[i] >> 1);
+        if (relocs[i] & 1) {
+            k = 0;
+            while (k < ncommon && common[k * 2] != *p) {
+                k++;
+            }
+            *p = (k < ncommon) ? common[k * 2 + 1] : (int64_t)(dbase + *p);
+        } else {
+            *p = (int64_t)(base + *p);
+        }
+        i++;
+    }
+    free(common);
+
+    i = 0;
+    while (i < header[ImgSymbols]) {
+        p = syms + i * 4;
+        id = (int64_t*)p[0];
+        stub = (id[Class] == Fun && !id[Extent]) ? (int64_t*)id[Value] : 0;
+        if (p[1] == ImgFun) {
+            if (id[Class] && !stub) {
+                printf("duplicate symbol %.*s\n", id_length(id), (char*)id[Name]);
+                return -1;
+            }
+            id[Class] = Fun;
+            id[Type] = INT;
+            id[Value] = (int64_t)(base + p[2]);
+            id[Extent] = (int64_t)(base + p[3]);
+            if (stub) {
+                stub[1] = id[Value];
+            }
+        } else if (p[1] == ImgImport) {
+            if (id[Class] == Fun) {
+                base[p[2] + 1] = id[Value];
+            } else if (id[Class]) {
+                printf("duplicate symbol %.*s\n", id_length(id), (char*)id[Name]);
+                return -1;
+            } else {
+                id[Class] = Fun;
+                id[Type] = INT;
+                id[Value] = (int64_t)(base + p[2]);
+            }
+        }
+        i++;
+    }
+    return 0;
+}
+
+// run the image `header` where it is mapped, returns the startup stub or 0
+int64_t* load_image(int64_t* header)
+{
+    old_text = header + ImgHeader;
+    text = old_text + header[ImgText];
+    text_line = (int*)(text + 1);
+    old_data = (char*)(text + 1) + ((header[ImgText] + 1) * sizeof(int) + 7) / 8 * 8;
+    data = old_data + header[ImgData];
+    if (link_unit(header, old_text, old_data)) {
+        return 0;
+    }
+    if (!header[ImgEntry]) {
+        printf("main() not defined\n");
+        return 0;
+    }
+    return old_text + header[ImgEntry];
+}
+
+// append the image `header` to the text and data segments and link it with
+// what is there, returns 0 or -1
+int link_image(int64_t* header)
+{
+    int64_t *base, *code;
+    char* dbase;
+
+    code = header + ImgHeader;
+    base = text;
+    dbase = (char*)(((int64_t)data + 7) & -8);
+    memcpy(base + 1, code + 1, header[ImgText] * sizeof(int64_t));
+    memcpy(text_line + (base - old_text) + 1, (int*)(code + header[ImgText] + 1) + 1,
+           header[ImgText] * sizeof(int));
+    memcpy(dbase, (char*)(code + header[ImgText] + 1) + ((header[ImgText] + 1) * sizeof(int) + 7) / 8 * 8,
+           header[ImgData]);
+    text = base + header[ImgText];
+    data = dbase + header[ImgData];
+    return link_unit(header, base, dbase);
+}
+
+#if defined(__GNUC__)
+// batch mode: main() of the compiled program runs once per line of an input
+// list, with the line as argv[1], on a pool of threads. The text segment is
+// shared, each worker keeps its own threaded translation of it, stack and
+// copy of the data segment. That copy is a private (copy-on-write) mapping
+// of a file holding the initial data segment, mapped afresh at the same
+// address for every input, so the translation stays valid. The output of
+// each input is collected and printed in input order.
+struct batch_worker {
+    pthread_t thread;
+    char* view;  // the worker's data segment
+    int64_t* code;  // threaded code, with data addresses rebased onto view
+    int64_t* stack;
+};
+char** batch_input;
+int batch_count;
+int batch_next;  // next input to run, taken with an atomic add
+char** batch_output;  // the output of each input
+size_t* batch_length;
+int* batch_status;  // the exit status of each input
+char* batch_script;  // argv[0]
+int64_t* batch_entry;  // the startup stub
+int batch_fd;  // the file holding the initial data segment
+int64_t batch_size;  // its size, in whole pages
+
+void* batch_work(void* arg)
+{
+    struct batch_worker* w;
+    char* argv[3];
+    int64_t* sp;
+    FILE* out;
+    int i;
+
+    w = arg;
+    while ((i = __sync_fetch_and_add(&batch_next, 1)) < batch_count) {
+        batch_status[i] = -1;
+        if (mmap(w->view, batch_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, batch_fd, 0) == MAP_FAILED ||
+            !(out = open_memstream(&batch_output[i], &batch_length[i]))) {
+            continue;
+        }
+        argv[0] = batch_script;
+        argv[1] = batch_input[i];
+        argv[2] = 0;
+        sp = (int64_t*)((char*)w->stack + stack_size);
+        *--sp = 2;
+        *--sp = (int64_t)argv;
+        batch_status[i] = eval_threaded(w->code + (batch_entry - old_text), sp, sp, out);
+        fclose(out);
+        heap_reset(0);  // the worker's heap starts empty for every input
+    }
+    return 0;
+}
+
+// run the program `script` compiled into text, whose startup stub is `stub`,
+// on each line of the file `list` with `jobs` threads. Returns 0 or -1.
+int batch_run(char* list, int jobs, char* script, int64_t* stub)
+{
+    struct batch_worker* worker;
+    FILE* in;
+    FILE* image;
+    char* buf;
+    size_t cap;
+    int64_t len, page;
+    int i, size;
+
+    if (!(in = strcmp(list, "-") ? fopen(list, "r") : stdin)) {
+        printf("could not open(%s)\n", list);
+        return -1;
     }
-    next(); current_id[Token] = Char;  // handle void type
-    next(); idmain = current_id;  // keep track of main
+    size = 1024;
+    batch_input = malloc(size * sizeof(char*));
+    batch_count = 0;
+    buf = 0;
+    cap = 0;
+    while ((len = getline(&buf, &cap, in)) >= 0) {
+        if (len > 0 && buf[len - 1] == '\n') {
+            buf[len - 1] = 0;
+        }
+        if (batch_count == size) {
+            size = size * 2;
+            batch_input = realloc(batch_input, size * sizeof(char*));
+        }
+        batch_input[batch_count++] = strdup(buf);
+    }
+    free(buf);
+    if (in != stdin) {
+        fclose(in);
+    }
+    batch_output = calloc(batch_count + 1, sizeof(char*));
+    batch_length = calloc(batch_count + 1, sizeof(size_t));
+    batch_status = calloc(batch_count + 1, sizeof(int));
+    batch_script = script;
+    batch_entry = stub;
+    batch_next = 0;
 
-    if ((fd = open(*argv, 0)) < 0) {
-        printf("could not open(%s)\n", *argv);
+    // the initial data segment, at least a page
+    page = getpagesize();
+    batch_size = (data - old_data + page) & -page;
+    if (!(image = tmpfile()) || fwrite(old_data, 1, batch_size, image) != batch_size || fflush(image)) {
+        printf("could not write the data segment for batch mode\n");
         return -1;
     }
-    if (!(src = old_src = malloc(poolsize))) {
-        printf("could not malloc(%d) for source area\n", poolsize);
+    batch_fd = fileno(image);
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > batch_count) {
+        jobs = batch_count;
+    }
+    worker = calloc(jobs, sizeof(struct batch_worker));
+    i = 0;
+    while (i < jobs) {
+        worker[i].view = mmap(0, batch_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, batch_fd, 0);
+        if (worker[i].view == MAP_FAILED ||
+            !(worker[i].code = threaded_code(worker[i].view)) ||
+            !(worker[i].stack = (int64_t*)segment_alloc("stack", &stack_size))) {
+            return -1;
+        }
+        if (pthread_create(&worker[i].thread, 0, batch_work, &worker[i])) {
+            printf("could not start batch worker %d\n", i);
+            return -1;
+        }
+        i++;
+    }
+    i = 0;
+    while (i < jobs) {
+        pthread_join(worker[i].thread, 0);
+        i++;
+    }
+
+    i = 0;
+    while (i < batch_count) {
+        printf("==> %s <==\n", batch_input[i]);
+        fwrite(batch_output[i], 1, batch_length[i], stdout);
+        printf("exit(%d)\n", batch_status[i]);
+        i++;
+    }
+    return 0;
+}
+#endif
+
+// server mode: the program is compiled and its init(), if it has one, run
+// once (it returns 0 on success). Then every connection to the Unix socket
+// forks a child from that warm process, so text, data, the symbol table and
+// whatever init() allocated are shared copy-on-write. The child reads the
+// request, its arguments each ended by a NUL byte and the whole ended by an
+// empty one or EOF, and runs main() with them after argv[0], its stdout
+// being the connection.
+//
+// Returns -1 on error; in each child it returns 0 with `*argc` and `*argv`
+// set for main().
+int serve_requests(char* path, char* script, int* argc, char*** argv)
+{
+    struct sockaddr_un addr;
+    int64_t* id;
+    char** args;
+    char* buf;
+    int fd, conn, n, len, size, i;
+
+    // the designated initialization, before the snapshot is taken
+    id = symbol_named("init");
+    if (id[Class] == Fun && id[Extent]) {
+        pc = text + 1;
+        pc[0] = CALL;
+        pc[1] = id[Value];
+        pc[2] = PUSH;
+        pc[3] = EXIT;
+        bp = sp = (int64_t*)((char*)stack + stack_size);
+        if (eval()) {
+            printf("init() failed\n");
+            return -1;
+        }
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path too long: %s\n", path);
         return -1;
     }
-    // read the source file
-    if ((i = read(fd, src, poolsize - 1)) <= 0) {
-        printf("read() returned %d\n", i);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0) {
+        printf("could not listen on %s\n", path);
         return -1;
     }
+    signal(SIGCHLD, SIG_IGN);  // the children are reaped by the kernel
+    fflush(stdout);
+
+    while (1) {
+        if ((conn = accept(fd, 0, 0)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            printf("accept failed on %s\n", path);
+            return -1;
+        }
+        if (fork() == 0) {
+            break;
+        }
+        close(conn);
+    }
 
-    src[i] = 0;  // add EOF character
+    // the child
     close(fd);
+    signal(SIGCHLD, SIG_DFL);
+    size = 4096;
+    len = 0;
+    buf = malloc(size);
+    while ((n = read(conn, buf + len, size - 1 - len)) > 0) {
+        len = len + n;
+        if (!buf[len - 1] && (len == 1 || !buf[len - 2])) {
+            break;  // the empty argument
+        }
+        if (len == size - 1) {
+            size = size * 2;
+            buf = realloc(buf, size);
+        }
+    }
+    if (len > 0 && buf[len - 1]) {
+        buf[len++] = 0;  // the last argument ended by EOF
+    }
 
-    program();
+    args = malloc((len + 2) * sizeof(char*));
+    args[0] = script;
+    n = 1;
+    i = 0;
+    while (i < len && buf[i]) {
+        args[n++] = buf + i;
+        i = i + strlen(buf + i) + 1;
+    }
+    args[n] = 0;
+    dup2(conn, 1);
+    close(conn);
+    *argc = n;
+    *argv = args;
+    return 0;
+}
 
-    // 设置程序启动运行的函数是main函数
-    // 之后手动调用main，放入2个参数到栈中，设置返回IP跳转地址
-    if (!(pc = (int64_t*)idmain[Value])) {
-        printf("main() not defined\n");
+// allocate the segments and the tables of the sizes set in text_size ...
+// symbols_size, and enter the keywords and the library in the symbol table.
+// Returns 0 or -1.
+int setup()
+{
+    int i;
+
+    line = 1;
+
+    // allocate memory for virtual, zero filled by mmap
+    if (!(text = old_text = (int64_t*)segment_alloc("text", &text_size)) ||
+        !(data = old_data = segment_alloc("data", &data_size)) ||
+        !(stack = (int64_t*)segment_alloc("stack", &stack_size)) ||
+        !(symbols = (int64_t*)segment_alloc("symbols", &symbols_size))) {
+        return -1;
+    }
+    symbols_end = symbols;
+
+    // hash index with at least twice as many slots as the table has entries
+    symbol_mask = 1;
+    while (symbol_mask + 1 < symbols_size / sizeof(int64_t) / IdSize * 2) {
+        symbol_mask = symbol_mask * 2 + 1;
+    }
+    symbol_index = calloc(symbol_mask + 1, sizeof(int64_t*));
+    scope = malloc(symbols_size / sizeof(int64_t) / IdSize * sizeof(int64_t*));
+    if (!symbol_index || !scope) {
+        printf("could not malloc for symbol index\n");
+        return -1;
+    }
+
+    // source line of each text cell, for the sampling profiler
+    if (!(text_line = calloc(text_size / sizeof(int64_t), sizeof(int)))) {
+        printf("could not malloc(%ld) for line table\n", text_size / 2);
+        return -1;
+    }
+    line_at = text;
+
+    // point to stack base/bottom
+    bp = sp = (int64_t*)((char*)stack + stack_size);
+    ax = 0;
+
+    heap_init();
+
+    // add keywords and library to symbol table
+    i = 0;
+    while (builtin[i].name) {
+        current_id = symbol_lookup(builtin[i].name, strlen(builtin[i].name), builtin[i].hash);
+        current_id[Token] = builtin[i].token;
+        if (builtin[i].class == Sys) {
+            current_id[Class] = Sys;
+            current_id[Type] = INT;
+            current_id[Value] = builtin[i].value;
+        }
+        i++;
+    }
+    idmain = current_id;  // keep track of main, the last one
+    return 0;
+}
+
+#ifdef CINTERP_LIBRARY
+#include "cinterp.h"
+
+// a context holds its own copy of the compiler globals, which are swapped
+// in while it compiles, under cinterp_lock. Its functions run on
+// eval_threaded(), as batch workers do: the virtual machine registers are
+// locals and the heap is per thread, so calls need no globals and calls on
+// different contexts run in parallel.
+struct cinterp {
+    pthread_mutex_t lock;  // held by calls and compiles, which share stack and code
+    pthread_mutex_t symbols_lock;  // held by compiles and function lookups
+    int64_t* code;  // threaded translation of text, and of a call stub past it
+    int64_t* stub;  // `CALL function; ADJ argc; PUSH; EXIT` in code
+    int undefined;  // functions declared by a prototype and not defined yet
+    int token;
+    char *src, *old_src;
+    int64_t text_size, data_size, stack_size, symbols_size;
+    int line;
+    int64_t *text, *old_text, *stack;
+    char *data, *old_data;
+    int64_t *pc, *bp, *sp, ax, cycle;
+    int64_t token_val;
+    int64_t *current_id, *symbols, *symbols_end;
+    int64_t** symbol_index;
+    int symbol_mask;
+    int64_t** scope;
+    int scope_top;
+    int64_t* idmain;
+    int basetype, expr_type, index_of_bp;
+    int64_t* function_entry;
+    int* text_line;
+    int64_t* line_at;
+    int inline_limit;
+    struct lexeme *lexemes, *lex_at;
+    int64_t *const_at, *call_at;
+    struct heap heap;
+    char** sources;  // the compiled sources, identifier names point into them
+    int nsources;
+};
+
+// held while a context is swapped in, to compile
+pthread_mutex_t cinterp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void swap_bytes(void* a, void* b, int n)
+{
+    char t[8];
+    memcpy(t, a, n);
+    memcpy(a, b, n);
+    memcpy(b, t, n);
+}
+
+// exchange the globals with the state kept in `c`
+void cinterp_swap(cinterp* c)
+{
+    struct heap tmp;
+
+#define SWAP(x) swap_bytes(&x, &c->x, sizeof(x))
+    SWAP(token);
+    SWAP(src);
+    SWAP(old_src);
+    SWAP(text_size);
+    SWAP(data_size);
+    SWAP(stack_size);
+    SWAP(symbols_size);
+    SWAP(line);
+    SWAP(text);
+    SWAP(old_text);
+    SWAP(stack);
+    SWAP(data);
+    SWAP(old_data);
+    SWAP(pc);
+    SWAP(bp);
+    SWAP(sp);
+    SWAP(ax);
+    SWAP(cycle);
+    SWAP(token_val);
+    SWAP(current_id);
+    SWAP(symbols);
+    SWAP(symbols_end);
+    SWAP(symbol_index);
+    SWAP(symbol_mask);
+    SWAP(scope);
+    SWAP(scope_top);
+    SWAP(idmain);
+    SWAP(basetype);
+    SWAP(expr_type);
+    SWAP(index_of_bp);
+    SWAP(function_entry);
+    SWAP(text_line);
+    SWAP(line_at);
+    SWAP(inline_limit);
+    SWAP(lexemes);
+    SWAP(lex_at);
+    SWAP(const_at);
+    SWAP(call_at);
+#undef SWAP
+    tmp = heap;
+    heap = c->heap;
+    c->heap = tmp;
+}
+
+void cinterp_enter(cinterp* c)
+{
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_lock(&c->symbols_lock);
+    pthread_mutex_lock(&cinterp_lock);
+    cinterp_swap(c);
+}
+
+void cinterp_leave(cinterp* c)
+{
+    cinterp_swap(c);
+    pthread_mutex_unlock(&cinterp_lock);
+    pthread_mutex_unlock(&c->symbols_lock);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// translate text for cinterp_call(), with the call stub laid right past it.
+// The stub stays out of text, the next compile writes over it.
+void cinterp_translate(cinterp* c)
+{
+    int64_t *end, *id;
+
+    c->undefined = 0;
+    id = symbols;
+    while (id[Token]) {
+        if (id[Class] == Fun && !id[Extent]) {
+            c->undefined++;
+        }
+        id = id + IdSize;
+    }
+    free(c->code);
+    end = text;
+    text[1] = CALL;
+    text[2] = 0;
+    text[3] = ADJ;
+    text[4] = 0;
+    text[5] = PUSH;
+    text[6] = EXIT;
+    text = text + 6;
+    c->code = threaded_code(old_data);
+    text = end;
+    c->stub = c->code ? c->code + (end + 1 - old_text) : 0;
+}
+
+cinterp* cinterp_new(void)
+{
+    cinterp* c;
+    int status;
+
+    if (!(c = calloc(1, sizeof(cinterp)))) {
+        return 0;
+    }
+    c->text_size = 16 << 20;
+    c->data_size = 16 << 20;
+    c->stack_size = 8 << 20;
+    c->symbols_size = 8 << 20;
+    c->inline_limit = 32;
+    pthread_mutex_init(&c->lock, 0);
+    pthread_mutex_init(&c->symbols_lock, 0);
+    cinterp_enter(c);
+    if (setjmp(cinterp_fail)) {
+        status = -1;
+    } else {
+        status = setup();
+    }
+    cinterp_leave(c);
+    if (status) {
+        cinterp_free(c);
+        return 0;
+    }
+    return c;
+}
+
+int cinterp_compile(cinterp* c, const char* source)
+{
+    char** sources;
+    char* copy;
+    int status;
+
+    if (!(sources = realloc(c->sources, (c->nsources + 1) * sizeof(char*)))) {
+        return -1;
+    }
+    c->sources = sources;
+    if (!(copy = strdup(source))) {
+        return -1;
+    }
+    c->sources[c->nsources++] = copy;
+
+    cinterp_enter(c);
+    if (setjmp(cinterp_fail)) {
+        // the locals of the function the error was in are still declared
+        scope_unwind();
+        // and the function itself, forgotten or back to its prototype
+        if (defining) {
+            if (defining_stub) {
+                defining[Value] = (int64_t)defining_stub;
+            } else {
+                defining[Class] = 0;
+            }
+            defining = 0;
+        }
+        status = -1;
+    } else {
+        src = old_src = copy;
+        compile_source(1, 1);
+        status = 0;
+    }
+    // also after an error, which leaves the functions compiled before it
+    cinterp_translate(c);
+    cinterp_leave(c);
+    return status;
+}
+
+void* cinterp_function(cinterp* c, const char* name)
+{
+    int64_t* id;
+
+    // look the name up without entering it in the symbol table
+    pthread_mutex_lock(&c->symbols_lock);
+    id = c->symbols;
+    while (id[Token] && !(id[Class] == Fun && id[Extent] && id_length(id) == strlen(name) &&
+                          !memcmp((char*)id[Name], name, id_length(id)))) {
+        id = id + IdSize;
+    }
+    pthread_mutex_unlock(&c->symbols_lock);
+    return id[Token] ? (void*)id[Value] : 0;
+}
+
+int cinterp_call(cinterp* c, void* function, int argc, const int64_t* args, int64_t* result)
+{
+    struct heap tmp;
+    int64_t* sp;
+    int i;
+
+    pthread_mutex_lock(&c->lock);
+    // a call reaching the JMP stub of a prototype never defined would spin
+    // there for good, holding the context
+    if (!c->stub || (c->undefined && link_check(c->symbols))) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    c->stub[1] = (int64_t)(c->code + ((int64_t*)function - c->old_text));
+    c->stub[3] = argc;
+    sp = (int64_t*)((char*)c->stack + c->stack_size);
+    i = 0;
+    while (i < argc) {
+        *--sp = args[i++];
+    }
+    tmp = heap;
+    heap = c->heap;
+    // EXIT returns the value the stub pushed, or the argument of exit()
+    *result = eval_threaded(c->stub, sp, sp, stdout);
+    c->heap = heap;
+    heap = tmp;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+void cinterp_free(cinterp* c)
+{
+    int i;
+
+    // the blocks the scripts allocated
+    cinterp_enter(c);
+    heap_reset(1);
+    cinterp_leave(c);
+    if (c->old_text) {
+        segment_free((char*)c->old_text, c->text_size);
+    }
+    if (c->old_data) {
+        segment_free(c->old_data, c->data_size);
+    }
+    if (c->stack) {
+        segment_free((char*)c->stack, c->stack_size);
+    }
+    if (c->symbols) {
+        segment_free((char*)c->symbols, c->symbols_size);
+    }
+    free(c->symbol_index);
+    free(c->scope);
+    free(c->text_line);
+    free(c->lexemes);
+    free(c->code);
+    i = 0;
+    while (i < c->nsources) {
+        free(c->sources[i++]);
+    }
+    free(c->sources);
+    pthread_mutex_destroy(&c->lock);
+    pthread_mutex_destroy(&c->symbols_lock);
+    free(c);
+}
+#else
+int main(int argc, char** argv)
+{
+    int i;
+    int64_t *tmp, *map;
+    int threaded;  // use the direct threaded dispatch engine
+    int fuse;  // run the superinstruction pass
+    int dce;  // run the jump threading and dead code pass
+    int registers;  // run on the register machine backend
+    int jit;  // translate to native code
+    char* emit;  // write the program as C source to this file
+    int dump;  // disassemble the program instead of running it
+    int compact;  // run the compact bytecode encoding
+    int image;  // the file argument is a compiled image
+    char* batch;  // run the program once per line of this file
+    char* serve;  // serve requests on this Unix socket
+    int jobs;  // worker threads of the batch mode
+    char* save;  // write the compiled image to this file instead of running
+    char** link;  // images to link with the program
+    int links;
+    int64_t result;
+
+    argc--;
+    argv++;
+
+    threaded = 0;
+    fuse = 1;
+    dce = 1;
+    inline_limit = 32;
+    registers = 0;
+    jit = 0;
+    emit = 0;
+    dump = 0;
+    compact = 0;
+    image = 0;
+    save = 0;
+    batch = 0;
+    serve = 0;
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    link = malloc(argc * sizeof(char*) + 1);
+    links = 0;
+    text_size = 16 << 20;
+    data_size = 16 << 20;
+    stack_size = 8 << 20;
+    symbols_size = 8 << 20;
+    while (argc > 0 && **argv == '-' && (*argv)[1]) {
+        if (!strcmp(*argv, "--threaded")) {
+#if defined(__GNUC__)
+            threaded = 1;
+#else
+            printf("threaded dispatch is not supported by this compiler\n");
+            return -1;
+#endif
+        } else if (!strcmp(*argv, "--no-fuse")) {
+            fuse = 0;
+        } else if (!strcmp(*argv, "--no-dce")) {
+            dce = 0;
+        } else if (!strncmp(*argv, "--inline=", 9)) {
+            inline_limit = atoi(*argv + 9);
+        } else if (!strcmp(*argv, "--jit")) {
+            jit = 1;
+            fuse = 0;
+        } else if (!strcmp(*argv, "--emit-c") && argc > 1) {
+            // the translation works on the plain stack code
+            emit = *++argv;
+            argc--;
+            fuse = 0;
+        } else if (!strncmp(*argv, "--text=", 7)) {
+            text_size = parse_size(*argv + 7);
+        } else if (!strncmp(*argv, "--data=", 7)) {
+            data_size = parse_size(*argv + 7);
+        } else if (!strncmp(*argv, "--stack=", 8)) {
+            stack_size = parse_size(*argv + 8);
+        } else if (!strncmp(*argv, "--symbols=", 10)) {
+            symbols_size = parse_size(*argv + 10);
+        } else if (!strcmp(*argv, "--save-image") && argc > 1) {
+            save = *++argv;
+            argc--;
+        } else if (!strcmp(*argv, "--link") && argc > 1) {
+            link[links++] = *++argv;
+            argc--;
+        } else if (!strcmp(*argv, "--batch") && argc > 1) {
+#if defined(__GNUC__)
+            // the workers run the threaded engine
+            batch = *++argv;
+            argc--;
+#else
+            printf("batch mode is not supported by this compiler\n");
+            return -1;
+#endif
+        } else if (!strcmp(*argv, "--serve") && argc > 1) {
+            serve = *++argv;
+            argc--;
+        } else if (!strncmp(*argv, "--jobs=", 7)) {
+            jobs = atoi(*argv + 7);
+        } else if (!strcmp(*argv, "--image")) {
+            image = 1;
+        } else if (!strcmp(*argv, "--dump")) {
+            dump = 1;
+        } else if (!strcmp(*argv, "--compact")) {
+            compact = 1;
+        } else if (!strcmp(*argv, "--profile")) {
+            // counts are taken by eval_counted(), which runs instead of the other engines
+            profiling = 1;
+        } else if (!strcmp(*argv, "--stats")) {
+            // the count is kept by eval_counted(), the other engines print nothing
+            stats = 1;
+        } else if (!strcmp(*argv, "--sample") && argc > 1) {
+            // folded stacks sampled every millisecond of CPU time, by eval_counted()
+            sample_path = *++argv;
+            argc--;
+        } else if (!strcmp(*argv, "--register")) {
+            // the register translator works on the plain stack code
+            registers = 1;
+            fuse = 0;
+        } else {
+            printf("unknown option: %s\n", *argv);
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (setup()) {
+        return -1;
+    }
+
+    // the program comes from a saved image or from source, read from
+    // standard input without a file argument. A lone image runs where it
+    // is mapped, linking copies every unit into the segments.
+    if (image && !links) {
+        if (!(tmp = map_image(argc > 0 ? *argv : "-")) || !(tmp = load_image(tmp))) {
+            return -1;
+        }
+    } else {
+        if (image) {
+            if (!(tmp = map_image(argc > 0 ? *argv : "-")) || link_image(tmp)) {
+                return -1;
+            }
+        } else if (compile(argc > 0 ? *argv : "-", dce, fuse)) {
+            return -1;
+        }
+        i = 0;
+        while (i < links) {
+            if (!(tmp = map_image(link[i])) || link_image(tmp)) {
+                return -1;
+            }
+            i++;
+        }
+        // calls go straight to their functions, which leaves the stubs
+        // of the units dead
+        link_calls();
+        if (dce && (image || links)) {
+            optimize_jumps(old_text + 1);
+        }
+        // a unit saved for linking may lack main() and import functions
+        if (!(tmp = startup()) && !save) {
+            printf("main() not defined\n");
+            return -1;
+        }
+    }
+    if (save) {
+        return save_image(save, tmp);
+    }
+    if (link_check(symbols)) {
         return -1;
     }
+    pc = tmp;
+    if (serve) {
+        // returns in a child forked for each request
+        if (serve_requests(serve, argc > 0 ? *argv : "-", &argc, &argv)) {
+            return -1;
+        }
+        pc = tmp;
+    }
+
     // setup stack
-    sp = (int64_t*)((int64_t)stack + poolsize);
-    *--sp = EXIT;  // call exit if main returns
-    *--sp = PUSH;
-    tmp = sp;
+    sp = (int64_t*)((int64_t)stack + stack_size);
     // push main函数的第一个参数
     *--sp = argc;
     // push main函数的第二个参数
     *--sp = (int64_t)argv;
-    // push main函数返回后的跳转地址IP
-    // 这个跳转地址就是之前的stack的位置，那里面存有PUSH op
-    //  EXIT
-    //  PUSH  <----- 跳转到这里
-    // 注意这里是一个栈
-    // PUSH指令将ax寄存器内容放入到--sp中
-    //   EXIT
-    //   PUSH  <------ IP执行这里
-    //   (ax)  <----- return from 用户代码中的main，sp指向这里
-    // 然后IP执行EXIT指令，将*sp返回，也就是(ax)
-    *--sp = (int64_t)tmp;
-    return eval();
+    if (emit) {
+        return emit_c(emit, tmp);
+    }
+#if defined(__GNUC__)
+    if (batch) {
+        return batch_run(batch, jobs, argc > 0 ? *argv : "-", tmp);
+    }
+#endif
+    if (dump) {
+        dump_text(tmp);
+        return 0;
+    }
+    if (profiling || sample_path) {
+        if (profiling) {
+            profile_start();
+        }
+        if (sample_path) {
+            sample_start(1000);
+        }
+        result = eval_counted();
+        printf("exit(%ld)", result);
+        return result;
+    }
+#if defined(__x86_64__)
+    if (jit) {
+        if (!jit_run(pc, sp, bp, &result)) {
+            printf("exit(%ld)", result);
+            return result;
+        }
+        // fall back to the interpreter for code the JIT cannot translate
+    }
+#endif
+    if (compact) {
+        map = compact_encode();
+        i = map[pc - old_text];
+        free(map);
+        return eval_compact(compact_code + i, sp, bp);
+    }
+    if (registers) {
+        if (!(reg_code = malloc(text_size)) || !(reg_const = malloc(text_size))) {
+            printf("could not malloc(%ld) for register code\n", text_size);
+            return -1;
+        }
+        tmp = reg_code;
+        map = reg_translate(pc);
+        pc = tmp + map[pc - old_text];
+        free(map);
+        return eval_register(pc, sp, bp);
+    }
+#if defined(__GNUC__)
+    if (threaded) {
+        if (!(tmp = threaded_code(old_data))) {
+            return -1;
+        }
+        result = eval_threaded(tmp + (pc - old_text), sp, bp, stdout);
+        printf("exit(%ld)", result);
+        return result;
+    }
+#endif
+    result = stats ? eval_counted() : eval();
+    printf("exit(%ld)", result);
+    return result;
 }
+#endif
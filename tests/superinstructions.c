@@ -0,0 +1,29 @@
+// each superinstruction is emitted: the peephole pass must not let a fused
+// instruction ending in PUSH take the PUSH of `x - 3` and the like, which
+// become LLI; SUBI. Run with --dump, whose listing names every one of
+// LLIP LLI LEAP IMMP LIP ADDI SUBI MULI LTI
+// Expected output (without --dump): 50 6
+int g, h;
+
+int sums(int n)
+{
+    int i, s;
+    s = 0;
+    i = 0;
+    while (i < 10) {
+        s = s + (i * n) + (n + 2) - (i - 3);
+        i = i + 1;
+    }
+    return s;
+}
+
+int main()
+{
+    int x, y;
+    g = 2;
+    h = 3;
+    x = 4;
+    y = x * 3;
+    printf("%d %d\n", sums(x) - 300 - y * x + 173, g * h);
+    return 0;
+}
@@ -0,0 +1,55 @@
+// a return whose call passes the address of a local or of a parameter must
+// not become a tail call: the callee reads through the pointer after the
+// caller's frame would be gone. Nor may any return of a function taking such
+// an address anywhere, even after the return, as in loop(). get() has locals
+// so that it is not inlined.
+// Expected output: f=42 g=7 loop=8
+int* gp;
+
+int get(int* p)
+{
+    int a, b, c;
+    a = 1;
+    b = 2;
+    c = 3;
+    return *p + a + b + c - 6;
+}
+
+int f(int x)
+{
+    int y;
+    y = 42;
+    return get(&y);
+}
+
+int g(int x)
+{
+    return get(&x);
+}
+
+int add(int n)
+{
+    int a, b, c;
+    a = 1;
+    b = 2;
+    c = 3;
+    return *gp + n + a + b + c - 6;
+}
+
+int loop(int n)
+{
+    int y;
+    y = 7;
+    while (n < 2) {
+        if (n == 1) return add(n);
+        gp = &y;
+        n = n + 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    printf("f=%d g=%d loop=%d\n", f(1), g(7), loop(0));
+    return 0;
+}